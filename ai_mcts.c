@@ -1,229 +1,849 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "ai_mcts.h"
+#include "bitboard.h"
 #include "game_util.h"
+#include "tablebase.h"
 #include "user_xoroshiro.h"
 
 #define ITERATIONS 1000
-#define FIXED_LN2 \
-    ((util_fixed_point_t) (0.69314718 * (1 << UTIL_FIXED_SCALE_BITS)))
 
-typedef struct node {
-    int move;
+/* Every iteration expands at most one leaf. A search may start from a tree of
+ * up to MAX_REUSED_NODES kept from the previous one.
+ */
+#define MAX_REUSED_NODES (ITERATIONS * UTIL_N_GRIDS)
+#define MAX_NODES (MAX_REUSED_NODES + ITERATIONS * UTIL_N_GRIDS + 1)
+
+#define MAX_THREADS 64
+#define MAX_BATCH 64
+
+/* A timed search reads the clock once every DEADLINE_CHECK_INTERVAL
+ * iterations of each thread, and never runs longer than MAX_BUDGET_US.
+ */
+#define DEADLINE_CHECK_INTERVAL 256
+#define MAX_BUDGET_US 1000000U
+
+/* An untimed search looks as often whether its move is already settled */
+#define EARLY_STOP_INTERVAL 64
+
+/* Nodes live in one arena and refer to each other by index. The children of
+ * a node are allocated together, so the visit counts and scores that UCT
+ * selection reads for them are adjacent in the arrays of mcts_obj.
+ *
+ * All search threads share the tree. A thread expands a leaf after claiming
+ * it by swapping first_child from NO_CHILDREN to EXPANDING, and publishes
+ * the children by storing n_children last, so a non-zero n_children read
+ * with acquire semantics makes first_child and the children valid.
+ */
+#define NO_CHILDREN -1
+#define EXPANDING -2
+
+/* Game-theoretic value of a node for the player who moved into it. Proofs
+ * only ever settle, so threads may store the same one concurrently.
+ */
+enum { UNPROVEN, PROVEN_WIN, PROVEN_LOSS, PROVEN_DRAW };
+
+typedef struct {
+    int parent; /* -1 for the root */
+    int first_child;
+    uint8_t n_children;
+    int8_t move;
     char player;
-    int n_visits;
-    util_fixed_point_t score;
-    struct node *parent;
-    struct node *children[UTIL_N_GRIDS];
+    int8_t proven;
 } node_t;
 
+static int n_threads = 1;
+static int batch_size = 1; /* playouts run from each leaf */
+
 static struct {
-    struct state_array xoro_obj;
+    struct state_array xoro_obj[MAX_THREADS];
     int nr_active_nodes;
+    int root;           /* tree of the last search, -1 if there is none */
+    board_t root_board; /* position at root */
+    char root_win;
+    int n_iterations;   /* iterations started by the current search */
+    int max_iterations; /* INT_MAX when the search runs against a deadline */
+    int64_t deadline;   /* CLOCK_MONOTONIC nsec, 0 for none */
+    bool stopped;       /* deadline passed or move settled */
+    int n_done;         /* iterations the threads completed */
+    unsigned long n_saved; /* see mcts_saved_iterations() */
+    node_t nodes[MAX_NODES];
+    uint32_t n_visits[MAX_NODES];
+    /* Sums of results, 2^UTIL_FIXED_SCALE_BITS per win. A timed search can
+     * win a node more than 2^16 times, which overflows 32 bits.
+     */
+    uint64_t score[MAX_NODES];
 } mcts_obj;
 
-static node_t *new_node(int move, char player, node_t *parent)
+static void init_node(int id, int move, char player, int parent)
 {
-    node_t *n = calloc(1, sizeof(node_t));
+    node_t *n = &mcts_obj.nodes[id];
+    n->parent = parent;
+    n->first_child = NO_CHILDREN;
+    n->n_children = 0;
     n->move = move;
     n->player = player;
-    n->parent = parent;
-    return n;
+    n->proven = UNPROVEN;
+    mcts_obj.n_visits[id] = 0;
+    mcts_obj.score[id] = 0;
 }
 
-static void free_node(node_t *node)
+/* The UCT terms only depend on visit counts, so they are tabulated by
+ * mcts_init(): uct_explore[N] is C * sqrt(ln N) with C = sqrt(2), uct_inv[n]
+ * and uct_inv_sqrt[n] are 1/n and 1/sqrt(n) scaled by 2^UCT_INV_BITS.
+ * Selection then only multiplies, except at counts past the tables, which
+ * only a timed search reaches.
+ */
+#define UCT_TABLE_SIZE (2 * ITERATIONS + 1)
+#define UCT_INV_BITS 24
+#define LN2_FIXED16 45426 /* ln(2) * 2^16 */
+
+static util_fixed_point_t uct_explore[UCT_TABLE_SIZE];
+static uint32_t uct_inv[UCT_TABLE_SIZE];
+static uint32_t uct_inv_sqrt[UCT_TABLE_SIZE];
+
+static uint32_t isqrt64(uint64_t x)
 {
-    for (int i = 0; i < UTIL_N_GRIDS; i++) {
-        if (node->children[i])
-            free_node(node->children[i]);
+    uint64_t r = 0, bit = 1ULL << 62;
+    while (bit > x)
+        bit >>= 2;
+    for (; bit; bit >>= 2) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
+        }
     }
-    free(node);
+    return r;
 }
 
-static util_fixed_point_t fixed_mul(util_fixed_point_t a, util_fixed_point_t b)
+/* log2(x) with 16 fractional bits, x >= 1 */
+static uint32_t log2_fixed16(uint32_t x)
 {
-    return (util_fixed_point_t) (((int64_t) a * b) >> UTIL_FIXED_SCALE_BITS);
+    int msb = 31 - __builtin_clz(x);
+    uint64_t y = ((uint64_t) x << 30) >> msb; /* x / 2^msb in [1, 2) */
+    uint32_t result = msb << 16;
+    for (int i = 15; i >= 0; i--) {
+        y = (y * y) >> 30;
+        if (y >= (2ULL << 30)) {
+            y >>= 1;
+            result |= 1U << i;
+        }
+    }
+    return result;
 }
 
-static util_fixed_point_t fixed_sqrt(util_fixed_point_t x)
+/* n >= 1 */
+static util_fixed_point_t uct_explore_of(uint32_t n)
 {
-    if (!x || x == (1U << UTIL_FIXED_SCALE_BITS))
-        return x;
+    uint64_t ln = ((uint64_t) log2_fixed16(n) * LN2_FIXED16) >> 16;
+    /* sqrt(2 * ln / 2^16) scaled by 2^UTIL_FIXED_SCALE_BITS */
+    return isqrt64((2 * ln << (2 * UTIL_FIXED_SCALE_BITS)) >> 16);
+}
 
-    util_fixed_point_t s = 0U;
-    for (int i = (31 - __builtin_clz(x | 1)); i >= 0; i--) {
-        util_fixed_point_t t = (1U << i);
-        if ((((s + t) * (s + t)) >> UTIL_FIXED_SCALE_BITS) <= x)
-            s += t;
-    }
-    return s;
+static uint32_t uct_inv_of(uint32_t n)
+{
+    return (1U << UCT_INV_BITS) / n;
 }
 
-static util_fixed_point_t fixed_log(util_fixed_point_t v)
+static uint32_t uct_inv_sqrt_of(uint32_t n)
 {
-    if (v == 0)
-        return 0;
+    return isqrt64((1ULL << (2 * UCT_INV_BITS)) / n);
+}
 
-    util_fixed_point_t y = v;
-    util_fixed_point_t L = 1 << (31 - __builtin_clz(y));
-    util_fixed_point_t R = L << 1;
-    util_fixed_point_t Llog = ((31 - __builtin_clz(y)) - UTIL_FIXED_SCALE_BITS)
-                              << UTIL_FIXED_SCALE_BITS;
-    util_fixed_point_t Rlog = Llog + (1 << UTIL_FIXED_SCALE_BITS);
-    util_fixed_point_t log;
-
-    for (int i = 0; i < 20; i++) {
-        if (y == L)
-            return fixed_mul(Llog, FIXED_LN2);
-        else if (y == R)
-            return fixed_mul(Rlog, FIXED_LN2);
-
-        log = (Llog + Rlog) >> 1;
-        int64_t tmp = (int64_t) L * R >> UTIL_FIXED_SCALE_BITS;
-        util_fixed_point_t mid = fixed_sqrt((util_fixed_point_t) tmp);
-
-        if (y >= mid) {
-            L = mid;
-            Llog = log;
-        } else {
-            R = mid;
-            Rlog = log;
-        }
+static void uct_tables_init(void)
+{
+    for (int n = 1; n < UCT_TABLE_SIZE; n++) {
+        uct_explore[n] = uct_explore_of(n);
+        uct_inv[n] = uct_inv_of(n);
+        uct_inv_sqrt[n] = uct_inv_sqrt_of(n);
     }
-
-    return fixed_mul(log, FIXED_LN2);
 }
 
-#define EXPLORATION_FACTOR fixed_sqrt(1U << (UTIL_FIXED_SCALE_BITS + 1))
+static inline util_fixed_point_t uct_explore_at(uint32_t n_visits)
+{
+    if (__builtin_expect(n_visits < UCT_TABLE_SIZE, 1))
+        return uct_explore[n_visits];
+    return uct_explore_of(n_visits);
+}
 
-static inline util_fixed_point_t uct_score(int n_total,
-                                           int n_visits,
-                                           util_fixed_point_t score)
+static inline util_fixed_point_t uct_score(util_fixed_point_t explore,
+                                           uint32_t n_visits,
+                                           uint64_t score)
 {
     if (n_visits == 0)
         return (util_fixed_point_t) (~0U);  // max value
 
-    util_fixed_point_t result =
-        (score << UTIL_FIXED_SCALE_BITS) / (n_visits << UTIL_FIXED_SCALE_BITS);
-    util_fixed_point_t tmp =
-        EXPLORATION_FACTOR *
-        fixed_sqrt(fixed_log(n_total << UTIL_FIXED_SCALE_BITS) / n_visits);
-    tmp >>= UTIL_FIXED_SCALE_BITS;
-    return result + tmp;
+    uint32_t inv, inv_sqrt;
+    if (__builtin_expect(n_visits < UCT_TABLE_SIZE, 1)) {
+        inv = uct_inv[n_visits];
+        inv_sqrt = uct_inv_sqrt[n_visits];
+    } else {
+        inv = uct_inv_of(n_visits);
+        inv_sqrt = uct_inv_sqrt_of(n_visits);
+    }
+    return (score * inv >> UCT_INV_BITS) +
+           ((uint64_t) explore * inv_sqrt >> UCT_INV_BITS);
+}
+
+#if defined(__SSE2__)
+/* Load the visit counts, scores, 1/n and 1/sqrt(n) of the four lanes, 0 for
+ * lanes past count. Other threads update the counters meanwhile, so each one
+ * is read atomically, and SSE2 has no conversion from unsigned or 64-bit
+ * integers, so the scores are converted one lane at a time.
+ */
+static inline void uct_gather(const uint32_t *visits,
+                              const uint64_t *scores,
+                              int i,
+                              int count,
+                              __m128i *n_visits,
+                              __m128 *score,
+                              __m128 *inv,
+                              __m128 *inv_sqrt)
+{
+    uint32_t lane_visits[4], lane_inv[4], lane_inv_sqrt[4];
+    float lane_score[4];
+    for (int k = 0; k < 4; k++) {
+        uint32_t n = 0;
+        lane_score[k] = 0;
+        if (i + k < count) {
+            n = __atomic_load_n(&visits[i + k], __ATOMIC_RELAXED);
+            lane_score[k] =
+                (float) __atomic_load_n(&scores[i + k], __ATOMIC_RELAXED);
+        }
+        lane_visits[k] = n;
+        if (__builtin_expect(n < UCT_TABLE_SIZE, 1)) {
+            lane_inv[k] = uct_inv[n];
+            lane_inv_sqrt[k] = uct_inv_sqrt[n];
+        } else {
+            lane_inv[k] = uct_inv_of(n);
+            lane_inv_sqrt[k] = uct_inv_sqrt_of(n);
+        }
+    }
+    *n_visits = _mm_loadu_si128((const __m128i *) lane_visits);
+    *score = _mm_loadu_ps(lane_score);
+    /* 1/n and 1/sqrt(n) are at most 2^UCT_INV_BITS, so a signed conversion
+     * is exact
+     */
+    *inv = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) lane_inv));
+    *inv_sqrt =
+        _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *) lane_inv_sqrt));
 }
 
-static node_t *select_move(node_t *node)
+/* Evaluate four children per step in single precision. Lanes past the last
+ * child are masked off like proven children, unvisited children score +inf,
+ * and ties resolve to the lowest index as in the scalar loop.
+ */
+static int select_move(int node)
+{
+    const node_t *n = &mcts_obj.nodes[node];
+    const int first = __atomic_load_n(&n->first_child, __ATOMIC_RELAXED);
+    const uint32_t *visits = &mcts_obj.n_visits[first];
+    const uint64_t *score = &mcts_obj.score[first];
+    const __m128 explore = _mm_set1_ps((float) uct_explore_at(
+        __atomic_load_n(&mcts_obj.n_visits[node], __ATOMIC_RELAXED)));
+    const __m128 inf = _mm_set1_ps(__builtin_inff());
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+    /* UCT values are never negative, but may be 0 */
+    __m128 best = _mm_set1_ps(-__builtin_inff());
+    __m128i best_idx = _mm_set1_epi32(-1);
+
+    for (int i = 0; i < n->n_children; i += 4) {
+        __m128i v;
+        __m128 sc, inv, inv_sqrt;
+        uct_gather(visits, score, i, n->n_children, &v, &sc, &inv, &inv_sqrt);
+        /* both terms carry UCT_INV_BITS extra bits, which keeps the order */
+        __m128 uct =
+            _mm_add_ps(_mm_mul_ps(sc, inv), _mm_mul_ps(explore, inv_sqrt));
+        __m128 unvisited =
+            _mm_castsi128_ps(_mm_cmpeq_epi32(v, _mm_setzero_si128()));
+        uct = _mm_or_ps(_mm_and_ps(unvisited, inf),
+                        _mm_andnot_ps(unvisited, uct));
+        __m128i idx = _mm_add_epi32(lane, _mm_set1_epi32(i));
+        int32_t open[4];
+        for (int k = 0; k < 4; k++) {
+            open[k] = i + k < n->n_children &&
+                      !__atomic_load_n(&mcts_obj.nodes[first + i + k].proven,
+                                       __ATOMIC_RELAXED);
+        }
+        __m128 valid = _mm_castsi128_ps(_mm_cmpgt_epi32(
+            _mm_loadu_si128((const __m128i *) open), _mm_setzero_si128()));
+        __m128 better = _mm_and_ps(valid, _mm_cmpgt_ps(uct, best));
+        best = _mm_or_ps(_mm_and_ps(better, uct), _mm_andnot_ps(better, best));
+        best_idx = _mm_or_si128(
+            _mm_and_si128(_mm_castps_si128(better), idx),
+            _mm_andnot_si128(_mm_castps_si128(better), best_idx));
+    }
+
+    float lane_best[4];
+    int lane_idx[4];
+    _mm_storeu_ps(lane_best, best);
+    _mm_storeu_si128((__m128i *) lane_idx, best_idx);
+    int best_child = -1;
+    float best_score = -__builtin_inff();
+    for (int k = 0; k < 4; k++) {
+        if (lane_idx[k] < 0)
+            continue;
+        if (lane_best[k] > best_score ||
+            (lane_best[k] == best_score && lane_idx[k] < best_child)) {
+            best_score = lane_best[k];
+            best_child = lane_idx[k];
+        }
+    }
+    return best_child < 0 ? -1 : first + best_child;
+}
+#else
+static int select_move(int node)
 {
-    node_t *best_node = NULL;
+    const node_t *n = &mcts_obj.nodes[node];
+    uint32_t n_visits =
+        __atomic_load_n(&mcts_obj.n_visits[node], __ATOMIC_RELAXED);
+    util_fixed_point_t explore = uct_explore_at(n_visits);
+    int first = __atomic_load_n(&n->first_child, __ATOMIC_RELAXED);
+    int best_node = -1;
     util_fixed_point_t best_score = 0U;
-    for (int i = 0; i < UTIL_N_GRIDS; i++) {
-        if (!node->children[i])
+    for (int i = first; i < first + n->n_children; i++) {
+        if (__atomic_load_n(&mcts_obj.nodes[i].proven, __ATOMIC_RELAXED))
             continue;
-        util_fixed_point_t score =
-            uct_score(node->n_visits, node->children[i]->n_visits,
-                      node->children[i]->score);
-        if (score > best_score) {
+        util_fixed_point_t score = uct_score(
+            explore, __atomic_load_n(&mcts_obj.n_visits[i], __ATOMIC_RELAXED),
+            __atomic_load_n(&mcts_obj.score[i], __ATOMIC_RELAXED));
+        if (best_node < 0 || score > best_score) {
             best_score = score;
-            best_node = node->children[i];
+            best_node = i;
         }
     }
     return best_node;
 }
+#endif
 
-static util_fixed_point_t simulate(const char *table, char player)
+/* Play randomly from board with player to move. The result is scored for the
+ * opponent of player, who made the move leading to board, as backpropagate()
+ * expects.
+ */
+static util_fixed_point_t playout(state_array *xoro,
+                                  const board_t *board,
+                                  char player)
 {
     char current_player = player;
-    char temp_table[UTIL_N_GRIDS];
-    memcpy(temp_table, table, UTIL_N_GRIDS);
-    xoro_jump(&mcts_obj.xoro_obj);
-    while (1) {
-        int *moves = available_moves(temp_table);
-        if (moves[0] == -1) {
-            free(moves);
-            break;
-        }
-        int n_moves = 0;
-        while (n_moves < UTIL_N_GRIDS && moves[n_moves] != -1)
-            ++n_moves;
-        int move = moves[xoro_next(&mcts_obj.xoro_obj) % n_moves];
-        free(moves);
-        temp_table[move] = current_player;
-        char win = check_win(temp_table);
-        if (win != ' ')
-            return calculate_win_value(win, player);
+    board_t b = *board;
+    bitboard_t empty = board_empty(&b);
+    int n_empty = bb_popcount(empty);
+    while (n_empty) {
+        int move = bitboard_nth(empty, xoro_bounded(xoro, n_empty));
+        bitboard_t *own = &b.bits[PLAYER_INDEX(current_player)];
+        *own |= BB_CELL(move);
+        empty &= ~BB_CELL(move);
+        n_empty--;
+        if (bitboard_wins_at(*own, move))
+            return calculate_win_value(current_player, player ^ 'O' ^ 'X');
         current_player ^= 'O' ^ 'X';
     }
     return 1U << (UTIL_FIXED_SCALE_BITS - 1);  // draw
 }
 
-static void backpropagate(node_t *node, util_fixed_point_t score)
+#if defined(__SSE2__) && N_GRIDS <= 16
+#define PLAYOUT_LANES 8
+
+/* Line masks broadcast to every lane and a byte-wise select table, so that
+ * picking the i-th empty cell costs two lookups instead of a loop.
+ */
+static __m128i lane_lines[N_LINE_SEGMENTS], lane_ends[N_LINE_SEGMENTS];
+static uint8_t nth_in_byte[256][8], bits_in_byte[256];
+
+static void playout_lanes_init(void)
+{
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        lane_lines[i] = _mm_set1_epi16(line_masks[i].line);
+        lane_ends[i] = _mm_set1_epi16(line_masks[i].ends);
+    }
+    for (int b = 0; b < 256; b++) {
+        int n = 0;
+        for (int i = 0; i < 8; i++) {
+            if (b & (1 << i))
+                nth_in_byte[b][n++] = i;
+        }
+        bits_in_byte[b] = n;
+    }
+}
+
+/* Play n <= PLAYOUT_LANES games from board in lockstep, one per 16-bit lane.
+ * All lanes start from the same position, so the side to move and the number
+ * of empty cells are the same in each of them at every step; only the cell
+ * drawn differs. Lanes stop counting once they have a winner, and the summed
+ * results are returned, scored as in playout().
+ */
+static uint32_t playout_lanes(state_array *xoro,
+                              const board_t *board,
+                              char player,
+                              int n)
 {
-    while (node) {
-        node->n_visits++;
-        node->score += score;
-        node = node->parent;
+    int side = PLAYER_INDEX(player), n_empty = bb_popcount(board_empty(board));
+    __m128i bits[2] = {_mm_set1_epi16(board->bits[0]),
+                       _mm_set1_epi16(board->bits[1])};
+    __m128i empty = _mm_set1_epi16(board_empty(board));
+    __m128i done = _mm_cmpgt_epi16(_mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0),
+                                   _mm_set1_epi16(n - 1));
+    __m128i won[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+
+    while (n_empty && _mm_movemask_epi8(done) != 0xffff) {
+        uint16_t lane_empty[PLAYOUT_LANES], cell[PLAYOUT_LANES];
+        _mm_storeu_si128((__m128i *) lane_empty, empty);
+        for (int k = 0; k < PLAYOUT_LANES; k += 4) {
+            uint64_t r = xoro_next(xoro);
+            for (int j = k; j < k + 4; j++, r >>= 16) {
+                unsigned e = lane_empty[j], lo = bits_in_byte[e & 0xff];
+                unsigned i = ((r & 0xffff) * n_empty) >> 16;
+                cell[j] = i < lo ? 1U << nth_in_byte[e & 0xff][i]
+                                 : 0x100U << nth_in_byte[e >> 8][i - lo];
+            }
+        }
+        __m128i c = _mm_loadu_si128((const __m128i *) cell);
+        __m128i own = _mm_or_si128(bits[side], c);
+        bits[side] = own;
+        empty = _mm_andnot_si128(c, empty);
+        n_empty--;
+
+        __m128i win = _mm_setzero_si128();
+        for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+            __m128i line = _mm_cmpeq_epi16(
+                _mm_and_si128(own, lane_lines[i]), lane_lines[i]);
+            __m128i clear = _mm_cmpeq_epi16(_mm_and_si128(own, lane_ends[i]),
+                                            _mm_setzero_si128());
+            win = _mm_or_si128(win, _mm_and_si128(line, clear));
+        }
+        win = _mm_andnot_si128(done, win);
+        won[side] = _mm_or_si128(won[side], win);
+        done = _mm_or_si128(done, win);
+        side ^= 1;
+    }
+
+    int mover = PLAYER_INDEX(player ^ 'O' ^ 'X');
+    int wins = __builtin_popcount(_mm_movemask_epi8(won[mover])) / 2;
+    int losses = __builtin_popcount(_mm_movemask_epi8(won[!mover])) / 2;
+    return (2 * wins + n - wins - losses) * (1U << (UTIL_FIXED_SCALE_BITS - 1));
+}
+#endif
+
+/* The mean result of batch_size playouts from board, which steadies the
+ * estimate of a leaf without another trip through the tree per playout.
+ */
+static util_fixed_point_t simulate(state_array *xoro,
+                                   const board_t *board,
+                                   char player)
+{
+    uint32_t sum = 0;
+    int n = 0;
+#if defined(PLAYOUT_LANES)
+    for (; batch_size - n > PLAYOUT_LANES / 2; n += PLAYOUT_LANES) {
+        int lanes = batch_size - n < PLAYOUT_LANES ? batch_size - n
+                                                   : PLAYOUT_LANES;
+        sum += playout_lanes(xoro, board, player, lanes);
+    }
+    if (n > batch_size)
+        n = batch_size;
+#endif
+    for (; n < batch_size; n++)
+        sum += playout(xoro, board, player);
+    return sum / batch_size;
+}
+
+/* Visits are counted on the way down, see search() */
+static void backpropagate(int node, util_fixed_point_t score)
+{
+    while (node >= 0) {
+        __atomic_fetch_add(&mcts_obj.score[node], score, __ATOMIC_RELAXED);
+        node = mcts_obj.nodes[node].parent;
         score = (1U << UTIL_FIXED_SCALE_BITS) - score;
     }
 }
 
-static int expand(node_t *node, const char *table)
+/* The value of node as settled by its children: lost once the opponent has
+ * a winning reply, otherwise known once every reply is. The sequentially
+ * consistent accesses make sure that of two threads proving the last two
+ * children, at least one sees both.
+ */
+static int proof_of(int node)
+{
+    const node_t *n = &mcts_obj.nodes[node];
+    int count = __atomic_load_n(&n->n_children, __ATOMIC_ACQUIRE);
+    bool unproven = false, draw = false;
+    for (int i = n->first_child; i < n->first_child + count; i++) {
+        switch (__atomic_load_n(&mcts_obj.nodes[i].proven, __ATOMIC_SEQ_CST)) {
+        case PROVEN_WIN:
+            return PROVEN_LOSS;
+        case PROVEN_DRAW:
+            draw = true;
+            break;
+        case UNPROVEN:
+            unproven = true;
+            break;
+        }
+    }
+    return unproven ? UNPROVEN : draw ? PROVEN_DRAW : PROVEN_WIN;
+}
+
+/* Record the value of a decided node and settle its ancestors from it */
+static void prove(int node, int value)
 {
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < UTIL_N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-    for (int i = 0; i < n_moves; i++) {
-        node->children[i] = new_node(moves[i], node->player ^ 'O' ^ 'X', node);
+    while (1) {
+        __atomic_store_n(&mcts_obj.nodes[node].proven, value, __ATOMIC_SEQ_CST);
+        node = mcts_obj.nodes[node].parent;
+        if (node < 0)
+            return;
+        value = proof_of(node);
+        if (value == UNPROVEN)
+            return;
     }
-    free(moves);
+}
+
+/* The result backpropagated for a node of the given value */
+static util_fixed_point_t proof_score(int value)
+{
+    if (value == PROVEN_WIN)
+        return 1U << UTIL_FIXED_SCALE_BITS;
+    if (value == PROVEN_LOSS)
+        return 0;
+    return 1U << (UTIL_FIXED_SCALE_BITS - 1);
+}
+
+/* Returns the number of children added, 0 if the arena cannot hold them or
+ * another thread is expanding node.
+ */
+static int expand(int node, const board_t *b)
+{
+    node_t *n = &mcts_obj.nodes[node];
+    bitboard_t empty = board_empty(b);
+    int n_moves = bb_popcount(empty), expected = NO_CHILDREN, first, move;
+    if (!__atomic_compare_exchange_n(&n->first_child, &expected, EXPANDING,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+        return 0;
+    first = __atomic_load_n(&mcts_obj.nr_active_nodes, __ATOMIC_RELAXED);
+    do {
+        if (first + n_moves > MAX_NODES) {
+            __atomic_store_n(&n->first_child, NO_CHILDREN, __ATOMIC_RELEASE);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&mcts_obj.nr_active_nodes, &first,
+                                          first + n_moves, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    int id = first;
+    bitboard_for_each(move, empty)
+        init_node(id++, move, n->player ^ 'O' ^ 'X', node);
+    __atomic_store_n(&n->first_child, first, __ATOMIC_RELAXED);
+    __atomic_store_n(&n->n_children, n_moves, __ATOMIC_RELEASE);
     return n_moves;
 }
 
-int mcts(const char *table, char player)
+static int find_child(int node, int move)
+{
+    const node_t *n = &mcts_obj.nodes[node];
+    for (int i = n->first_child; i < n->first_child + n->n_children; i++) {
+        if (mcts_obj.nodes[i].move == move)
+            return i;
+    }
+    return -1;
+}
+
+/* The node of the last tree for position b with player to move. Between two
+ * searches of a game, the side that searched has made its move and the
+ * opponent has replied, so b is at most two plies below the old root.
+ */
+static int find_reusable(const board_t *b, char player)
+{
+    int node = mcts_obj.root;
+    if (node < 0)
+        return -1;
+    int own = PLAYER_INDEX(mcts_obj.nodes[node].player);
+    bitboard_t old_own = mcts_obj.root_board.bits[own];
+    bitboard_t old_other = mcts_obj.root_board.bits[!own];
+    if ((old_own & ~b->bits[own]) || (old_other & ~b->bits[!own]))
+        return -1; /* a different game */
+    bitboard_t added_own = b->bits[own] & ~old_own;
+    bitboard_t added_other = b->bits[!own] & ~old_other;
+    if (bb_popcount(added_own) > 1 || bb_popcount(added_other) > 1 ||
+        (added_other && !added_own))
+        return -1;
+    if (added_own)
+        node = find_child(node, __builtin_ctz(added_own));
+    if (node >= 0 && added_other)
+        node = find_child(node, __builtin_ctz(added_other));
+    return node >= 0 && mcts_obj.nodes[node].player == player ? node : -1;
+}
+
+/* Move the subtree under root to the front of the arena and drop the rest.
+ * Children always come after their parent, so one pass in arena order can
+ * mark the nodes outside the subtree, by setting their parent to -2, and a
+ * second one can slide the others down without overwriting a node it has yet
+ * to visit. Returns -1 if the subtree is too big to keep.
+ */
+static int reuse_tree(int root)
+{
+    node_t *nodes = mcts_obj.nodes;
+    int n_kept = 1;
+    for (int i = root + 1; i < mcts_obj.nr_active_nodes; i++) {
+        int parent = nodes[i].parent;
+        if (parent < root || (parent != root && nodes[parent].parent == -2))
+            nodes[i].parent = -2;
+        else
+            n_kept++;
+    }
+    if (n_kept > MAX_REUSED_NODES)
+        return -1;
+
+    int dst = 0;
+    for (int i = root; i < mcts_obj.nr_active_nodes; i++) {
+        if (i != root && nodes[i].parent == -2)
+            continue;
+        if (dst != i) {
+            node_t *n = &nodes[dst];
+            *n = nodes[i];
+            mcts_obj.n_visits[dst] = mcts_obj.n_visits[i];
+            mcts_obj.score[dst] = mcts_obj.score[i];
+            if (i != root && nodes[n->parent].first_child == i)
+                nodes[n->parent].first_child = dst;
+            for (int c = n->first_child; c < n->first_child + n->n_children;
+                 c++)
+                nodes[c].parent = dst;
+        }
+        dst++;
+    }
+    mcts_obj.nr_active_nodes = n_kept;
+    nodes[0].parent = -1;
+    nodes[0].move = -1;
+    return 0;
+}
+
+static int64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Whether the most visited root child, leaving out proven losses, stays ahead
+ * even if all remaining iterations go to its closest rival. Each iteration
+ * adds at most one root child visit, and those in flight are counted already.
+ */
+static bool decided(int root, int remaining)
+{
+    const node_t *r = &mcts_obj.nodes[root];
+    int count = __atomic_load_n(&r->n_children, __ATOMIC_ACQUIRE);
+    int64_t first = -1, second = -1;
+    for (int i = r->first_child; i < r->first_child + count; i++) {
+        if (__atomic_load_n(&mcts_obj.nodes[i].proven, __ATOMIC_RELAXED) ==
+            PROVEN_LOSS)
+            continue;
+        int64_t v = __atomic_load_n(&mcts_obj.n_visits[i], __ATOMIC_RELAXED);
+        if (v > first) {
+            second = first;
+            first = v;
+        } else if (v > second) {
+            second = v;
+        }
+    }
+    return first >= 0 && (second < 0 || first - second > remaining);
+}
+
+/* One search thread, drawing from its own random stream. Iterations are
+ * handed out by a shared counter. A visit is counted as soon as the descent
+ * passes a node, before the playout result is backpropagated, which acts as
+ * a virtual loss that steers the other threads to different paths. The first
+ * thread to see the deadline pass, or the move settled, stops the others.
+ */
+static void *search(void *xoro)
 {
-    node_t *root = new_node(-1, player, NULL);
-    mcts_obj.nr_active_nodes = 1;
-    for (int i = 0; i < ITERATIONS; i++) {
-        node_t *node = root;
-        char temp_table[UTIL_N_GRIDS];
-        memcpy(temp_table, table, UTIL_N_GRIDS);
+    const int root = mcts_obj.root;
+    int done = 0;
+    while (__atomic_fetch_add(&mcts_obj.n_iterations, 1, __ATOMIC_RELAXED) <
+               mcts_obj.max_iterations &&
+           !__atomic_load_n(&mcts_obj.nodes[root].proven, __ATOMIC_RELAXED)) {
+        if (__atomic_load_n(&mcts_obj.stopped, __ATOMIC_RELAXED))
+            break;
+        if (mcts_obj.deadline && done && !(done % DEADLINE_CHECK_INTERVAL) &&
+            now_nsec() >= mcts_obj.deadline) {
+            __atomic_store_n(&mcts_obj.stopped, true, __ATOMIC_RELAXED);
+            break;
+        }
+        if (!mcts_obj.deadline && done && !(done % EARLY_STOP_INTERVAL) &&
+            decided(root, mcts_obj.max_iterations -
+                              __atomic_load_n(&mcts_obj.n_iterations,
+                                              __ATOMIC_RELAXED))) {
+            __atomic_store_n(&mcts_obj.stopped, true, __ATOMIC_RELAXED);
+            break;
+        }
+        int node = root;
+        board_t b = mcts_obj.root_board;
+        char win = mcts_obj.root_win;
         while (1) {
-            char win = check_win(temp_table);
+            const node_t *n = &mcts_obj.nodes[node];
+            uint32_t visits =
+                __atomic_fetch_add(&mcts_obj.n_visits[node], 1,
+                                   __ATOMIC_RELAXED);
             if (win != ' ') {
                 util_fixed_point_t score =
-                    calculate_win_value(win, node->player ^ 'O' ^ 'X');
+                    calculate_win_value(win, n->player ^ 'O' ^ 'X');
+                prove(node, win == 'D' ? PROVEN_DRAW : PROVEN_WIN);
                 backpropagate(node, score);
                 break;
             }
-            if (node->n_visits == 0) {
-                util_fixed_point_t score = simulate(temp_table, node->player);
+            if (visits == 0) {
+                util_fixed_point_t score = simulate(xoro, &b, n->player);
                 backpropagate(node, score);
                 break;
             }
-            if (!node->children[0])
-                mcts_obj.nr_active_nodes += expand(node, temp_table);
-            node = select_move(node);
-            if (!node)
-                return -1;
-            temp_table[node->move] = node->player ^ 'O' ^ 'X';
+            if (!__atomic_load_n(&n->n_children, __ATOMIC_ACQUIRE) &&
+                !expand(node, &b)) {
+                backpropagate(node, simulate(xoro, &b, n->player));
+                break;
+            }
+            int child = select_move(node);
+            if (child < 0) {
+                /* All children are proven, so is the node. Back its value
+                 * up to match the visits counted on the way down.
+                 */
+                int value = proof_of(node);
+                if (value != UNPROVEN)
+                    prove(node, value);
+                backpropagate(node, proof_score(value));
+                break;
+            }
+            node = child;
+            n = &mcts_obj.nodes[node];
+            char mover = n->player ^ 'O' ^ 'X';
+            board_play(&b, n->move, mover);
+            win = board_check_win_after(&b, n->move, mover);
         }
+        done++;
     }
-    node_t *best_node = NULL;
-    int best_visits = -1;
-    for (int i = 0; i < UTIL_N_GRIDS; i++) {
-        if (root->children[i] && root->children[i]->n_visits > best_visits) {
-            best_visits = root->children[i]->n_visits;
-            best_node = root->children[i];
-        }
+    __atomic_fetch_add(&mcts_obj.n_done, done, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int mcts(const char *table,
+         char player,
+         unsigned int budget_us,
+         int *iterations)
+{
+    board_t root_board;
+    board_from_table(&root_board, table);
+    int move = tablebase_move(&root_board, player);
+    if (move >= 0) {
+        if (iterations)
+            *iterations = 0;
+        return move;
+    }
+    int root = find_reusable(&root_board, player);
+    if (root >= 0)
+        root = reuse_tree(root);
+    if (root < 0) {
+        root = 0;
+        init_node(root, -1, player, -1);
+        mcts_obj.nr_active_nodes = 1;
+    }
+    mcts_obj.root = root;
+    mcts_obj.root_board = root_board;
+    mcts_obj.root_win = board_check_win(&root_board);
+    mcts_obj.n_iterations = 0;
+    mcts_obj.n_done = 0;
+    mcts_obj.stopped = false;
+    if (budget_us) {
+        if (budget_us > MAX_BUDGET_US)
+            budget_us = MAX_BUDGET_US;
+        mcts_obj.max_iterations = INT_MAX;
+        mcts_obj.deadline = now_nsec() + (int64_t) budget_us * 1000;
+    } else {
+        mcts_obj.max_iterations = ITERATIONS;
+        mcts_obj.deadline = 0;
+    }
+
+    pthread_t threads[MAX_THREADS];
+    int n_started = 1;
+    while (n_started < n_threads &&
+           !pthread_create(&threads[n_started], NULL, search,
+                           &mcts_obj.xoro_obj[n_started]))
+        n_started++;
+    search(&mcts_obj.xoro_obj[0]);
+    for (int i = 1; i < n_started; i++)
+        pthread_join(threads[i], NULL);
+    if (iterations)
+        *iterations = mcts_obj.n_done;
+    if (!mcts_obj.deadline)
+        mcts_obj.n_saved += ITERATIONS - mcts_obj.n_done;
+
+    /* A proven win beats any visit count, a proven loss is the last resort */
+    static const int rank[] = {
+        [UNPROVEN] = 1, [PROVEN_WIN] = 2, [PROVEN_LOSS] = 0, [PROVEN_DRAW] = 1};
+    const node_t *r = &mcts_obj.nodes[root];
+    int best = -1;
+    for (int i = r->first_child; i < r->first_child + r->n_children; i++) {
+        int d = best < 0 ? 1
+                         : rank[mcts_obj.nodes[i].proven] -
+                               rank[mcts_obj.nodes[best].proven];
+        if (d > 0 || (d == 0 && mcts_obj.n_visits[i] > mcts_obj.n_visits[best]))
+            best = i;
+    }
+    return best < 0 ? -1 : mcts_obj.nodes[best].move;
+}
+
+unsigned long mcts_saved_iterations(void)
+{
+    return mcts_obj.n_saved;
+}
+
+void mcts_set_threads(int threads)
+{
+    n_threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+void mcts_set_batch(int playouts)
+{
+    batch_size = playouts < 1           ? 1
+                 : playouts > MAX_BATCH ? MAX_BATCH
+                                        : playouts;
+}
+
+/* Each thread owns a stream started 2^96 draws after the previous one, so
+ * playouts draw from it without sharing or jumping.
+ */
+static void split_streams(void)
+{
+    for (int i = 1; i < MAX_THREADS; i++) {
+        mcts_obj.xoro_obj[i] = mcts_obj.xoro_obj[i - 1];
+        xoro_long_jump(&mcts_obj.xoro_obj[i]);
     }
-    int best_move = best_node ? best_node->move : -1;
-    free_node(root);
-    return best_move;
+}
+
+void mcts_set_seed(uint64_t seed)
+{
+    if (seed)
+        xoro_seed(&mcts_obj.xoro_obj[0], seed);
+    else
+        xoro_init(&mcts_obj.xoro_obj[0]);
+    split_streams();
+    mcts_obj.root = -1;
 }
 
 void mcts_init(void)
 {
-    xoro_init(&mcts_obj.xoro_obj);
+    bitboard_init();
+    xoro_init(&mcts_obj.xoro_obj[0]);
+    split_streams();
     mcts_obj.nr_active_nodes = 0;
-}
\ No newline at end of file
+    mcts_obj.root = -1;
+    mcts_obj.n_saved = 0;
+    uct_tables_init();
+#if defined(PLAYOUT_LANES)
+    playout_lanes_init();
+#endif
+}
@@ -1,8 +1,34 @@
 #ifndef AI_MCTS_H
 #define AI_MCTS_H
 
-int mcts(const char *table, char player);
+#include <stdint.h>
+
+/* Pick a move for player. A non-zero budget_us searches for that long, up to
+ * one second, instead of a fixed number of iterations. The iterations run are
+ * stored in *iterations unless it is NULL.
+ */
+int mcts(const char *table,
+         char player,
+         unsigned int budget_us,
+         int *iterations);
 
 void mcts_init(void);
 
+/* Iterations that untimed searches have skipped since mcts_init() because
+ * their move was settled early, by a proof or by its lead in visits.
+ */
+unsigned long mcts_saved_iterations(void);
+
+/* Number of threads sharing the tree of a search, 1 by default */
+void mcts_set_threads(int threads);
+
+/* Number of playouts averaged for each new leaf, 1 by default */
+void mcts_set_batch(int playouts);
+
+/* Restart the random streams from seed, or from the clock if it is 0, and
+ * drop the kept tree. With one thread, the same seed then replays the same
+ * searches.
+ */
+void mcts_set_seed(uint64_t seed);
+
 #endif
@@ -1,114 +1,329 @@
 #include "ai_negamax.h"
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "bitboard.h"
 #include "game_util.h"
+#include "tablebase.h"
 #include "user_zobrist.h"
 #include "util.h"
 
 #define MAX_SEARCH_DEPTH 6
 
-static int history_score_sum[N_GRIDS];
-static int history_count[N_GRIDS];
+/* Late-move reductions: past the first LMR_FULL_MOVES moves of a node with
+ * at least LMR_MIN_DEPTH plies left, a move is searched one ply shallower,
+ * and again at full depth only if it then beats alpha.
+ */
+#define LMR_FULL_MOVES 3
+#define LMR_MIN_DEPTH 3
 
-static uint64_t hash_value;
+/* Futility pruning: a move never raises the get_score() of the opponent, so
+ * with up to two plies left the score right after our move bounds its value
+ * and a move not beating alpha that way is not searched. Up to
+ * FUTILITY_DEPTH plies, each further move of ours is assumed to gain at most
+ * futility_margin, which is a guess and no longer a bound.
+ */
+#define FUTILITY_DEPTH 4
 
-static int cmp_moves(const void *a, const void *b)
+#define MAX_THREADS 64
+
+/* The last two moves that caused a beta cutoff, per number of stones on the
+ * board, which is the ply counted from the start of the game.
+ */
+#define N_KILLERS 2
+
+/* Search state of one thread. Moves are tried in order of the average score
+ * they got so far, kept up to date in history_score[] so that picking one
+ * needs no division.
+ */
+typedef struct {
+    eval_t e;
+    int history_score_sum[N_GRIDS];
+    int history_count[N_GRIDS];
+    int history_score[N_GRIDS];
+    int8_t killers[N_GRIDS][N_KILLERS];
+    bool stop; /* abandon the search, set for helpers only */
+    bool lmr, futility; /* settings of the current search */
+    board_t board;
+    char player;
+} negamax_worker_t;
+
+/* Lazy SMP: the other threads search the same root as workers[0], half of
+ * them one ply deeper, and only share what they find through the
+ * transposition table. They are stopped as soon as the first one is done,
+ * whose move is the one played.
+ */
+static negamax_worker_t workers[MAX_THREADS];
+static int n_threads = 1;
+static int search_depth = MAX_SEARCH_DEPTH;
+static bool use_lmr, use_futility;
+static int futility_margin;
+
+enum { PICK_TT, PICK_KILLERS, PICK_HISTORY = PICK_KILLERS + N_KILLERS };
+
+/* Hands out the moves of a node in stages: the move of its transposition
+ * table entry, the killers of its ply, then the others by history score.
+ * Each one is picked when it is needed, so a cutoff saves ordering the rest.
+ */
+typedef struct {
+    bitboard_t left; /* moves not handed out yet */
+    int stage;
+    int tt_move;
+    const int8_t *killers;
+    const int *history_score;
+} move_picker_t;
+
+static void picker_init(move_picker_t *p,
+                        const negamax_worker_t *w,
+                        int tt_move,
+                        const int8_t *ply_killers)
 {
-    int move_a = *(const int *) a;
-    int move_b = *(const int *) b;
-    int score_a = history_count[move_a]
-                      ? history_score_sum[move_a] / history_count[move_a]
-                      : 0;
-    int score_b = history_count[move_b]
-                      ? history_score_sum[move_b] / history_count[move_b]
-                      : 0;
-    return score_b - score_a;
+    p->left = board_empty(&w->e.board);
+    p->stage = PICK_TT;
+    p->tt_move = tt_move;
+    p->killers = ply_killers;
+    p->history_score = w->history_score;
 }
 
-static move_t negamax(char *table, int depth, char player, int alpha, int beta)
+/* The next move to search, or -1 when there is none left */
+static int picker_next(move_picker_t *p)
 {
-    if (check_win(table) != ' ' || depth == 0) {
-        move_t result = {get_score(table, player), -1};
-        return result;
+    int move, best = -1;
+
+    while (p->stage < PICK_HISTORY) {
+        move = p->stage == PICK_TT ? p->tt_move
+                                   : p->killers[p->stage - PICK_KILLERS];
+        p->stage++;
+        if (move >= 0 && (p->left & BB_CELL(move))) {
+            p->left &= ~BB_CELL(move);
+            return move;
+        }
+    }
+    bitboard_for_each(move, p->left) {
+        if (best < 0 || p->history_score[move] > p->history_score[best])
+            best = move;
     }
+    if (best >= 0)
+        p->left &= ~BB_CELL(best);
+    return best;
+}
 
-    const zobrist_entry_t *entry = zobrist_get(hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
+static void history_update(negamax_worker_t *w, int move, int score)
+{
+    w->history_count[move]++;
+    w->history_score_sum[move] += score;
+    w->history_score[move] =
+        w->history_score_sum[move] / w->history_count[move];
+}
 
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
+static void killer_update(int8_t *ply_killers, int move)
+{
+    if (ply_killers[0] == move)
+        return;
+    for (int i = N_KILLERS - 1; i > 0; i--)
+        ply_killers[i] = ply_killers[i - 1];
+    ply_killers[0] = move;
+}
+
+static move_t negamax(negamax_worker_t *w,
+                      int depth,
+                      char player,
+                      int alpha,
+                      int beta)
+{
+    eval_t *e = &w->e;
+    if (depth == 0) {
+        move_t result = {eval_score(e, player), -1};
+        return result;
+    }
 
-    qsort(moves, n_moves, sizeof(int), cmp_moves);
+    /* Scores are relative to the side to move, so it is part of the key. All
+     * images of the position share the entry of its canonical form, which
+     * holds the move as played there.
+     */
+    board_t canonical = e->board;
+    int sym = board_canonical(&canonical);
+    uint64_t key = zobrist_board_key(&canonical);
+    if (player == 'O')
+        key ^= zobrist_player;
+    zobrist_entry_t entry;
+    int tt_move = -1;
+    if (zobrist_get(key, &entry)) {
+        move_t stored = {
+            .score = entry.score,
+            .move = bitboard_transform_move(entry.move, sym_inverse[sym]),
+        };
+        if (entry.depth >= depth) {
+            if (entry.bound == ZOBRIST_EXACT)
+                return stored;
+            if (entry.bound == ZOBRIST_LOWER && stored.score > alpha)
+                alpha = stored.score;
+            else if (entry.bound == ZOBRIST_UPPER && stored.score < beta)
+                beta = stored.score;
+            if (alpha >= beta)
+                return stored;
+        }
+        tt_move = stored.move;
+    }
 
     move_t best_move = {-10000, -1};
+    int alpha_orig = alpha;
+    int8_t *ply_killers =
+        w->killers[bb_popcount(e->board.bits[0] | e->board.bits[1])];
+
+    move_picker_t picker;
+    /* What our later moves may add to a score, -1 not to prune */
+    int margin = w->futility && depth <= FUTILITY_DEPTH
+                     ? (depth - 1) / 2 * futility_margin
+                     : -1;
 
-    for (int i = 0; i < n_moves; i++) {
-        int move = moves[i];
-        table[move] = player;
-        hash_value ^= zobrist_table[move][player == 'X'];
+    picker_init(&picker, w, tt_move, ply_killers);
+
+    int move;
+    for (int i = 0; (move = picker_next(&picker)) >= 0; i++) {
+        eval_play(e, move, player);
 
         int score;
-        if (!i) {
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X', -beta,
+        if (board_check_win_after(&e->board, move, player) != ' ') {
+            score = eval_score(e, player);
+        } else if (margin >= 0 && eval_score(e, player) + margin <= alpha) {
+            score = eval_score(e, player) + margin;
+        } else if (!i) {
+            score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X', -beta,
                              -alpha)
                          .score;
         } else {
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
+            int reduced =
+                w->lmr && i >= LMR_FULL_MOVES && depth >= LMR_MIN_DEPTH;
+            score = -negamax(w, depth - 1 - reduced, player == 'X' ? 'O' : 'X',
                              -alpha - 1, -alpha)
                          .score;
+            if (reduced && score > alpha) {
+                score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X',
+                                 -alpha - 1, -alpha)
+                             .score;
+            }
             if (alpha < score && score < beta) {
-                score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
+                score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X',
                                  -beta, -score)
                              .score;
             }
         }
 
-        history_count[move]++;
-        history_score_sum[move] += score;
+        eval_undo(e, move, player);
+
+        /* The scores of an abandoned search are meaningless */
+        if (__atomic_load_n(&w->stop, __ATOMIC_RELAXED))
+            return best_move;
+
+        history_update(w, move, score);
 
         if (score > best_move.score) {
             best_move.score = score;
             best_move.move = move;
         }
 
-        table[move] = ' ';
-        hash_value ^= zobrist_table[move][player == 'X'];
-
         if (score > alpha)
             alpha = score;
-        if (alpha >= beta)
+        if (alpha >= beta) {
+            killer_update(ply_killers, move);
             break;
+        }
     }
 
-    free(moves);
-    zobrist_put(hash_value, best_move.score, best_move.move);
+    zobrist_put(key, best_move.score,
+                bitboard_transform_move(best_move.move, sym), depth,
+                best_move.score <= alpha_orig ? ZOBRIST_UPPER
+                : best_move.score >= beta     ? ZOBRIST_LOWER
+                                              : ZOBRIST_EXACT);
     return best_move;
 }
 
+static void worker_reset(negamax_worker_t *w, const board_t *b)
+{
+    w->lmr = use_lmr;
+    w->futility = use_futility;
+    memset(w->history_score_sum, 0, sizeof(w->history_score_sum));
+    memset(w->history_count, 0, sizeof(w->history_count));
+    memset(w->history_score, 0, sizeof(w->history_score));
+    memset(w->killers, -1, sizeof(w->killers));
+    eval_init(&w->e, b);
+}
+
+/* Helpers deepen by two plies like the first thread, the odd ones starting
+ * one ply deeper, until they are stopped.
+ */
+static void *helper_search(void *arg)
+{
+    negamax_worker_t *w = arg;
+    int max_depth = bb_popcount(board_empty(&w->board));
+    worker_reset(w, &w->board);
+    for (int depth = 2 + (w - workers) % 2;
+         depth <= max_depth && !__atomic_load_n(&w->stop, __ATOMIC_RELAXED);
+         depth += 2)
+        negamax(w, depth, w->player, -100000, 100000);
+    return NULL;
+}
+
 void negamax_init(void)
 {
+    bitboard_init();
     zobrist_init();
-    hash_value = 0;
+    futility_margin = line_scores[GOAL - 1];
 }
 
 move_t negamax_predict(char *table, char player)
 {
-    for (int i = 0; i < N_GRIDS; ++i) {
-        if (table[i] == 'X')
-            hash_value ^= zobrist_table[i][1];
-        else if (table[i] == 'O')
-            hash_value ^= zobrist_table[i][0];
-    }
-    memset(history_score_sum, 0, sizeof(history_score_sum));
-    memset(history_count, 0, sizeof(history_count));
     move_t result = {-1, -1};
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(table, depth, player, -100000, 100000);
-        zobrist_clear();
+    board_t b;
+    board_from_table(&b, table);
+    if (board_check_win(&b) != ' ')
+        return (move_t){.score = get_board_score(&b, player), .move = -1};
+    int move = tablebase_move(&b, player);
+    if (move >= 0) {
+        board_play(&b, move, player);
+        return (move_t){.score = get_board_score(&b, player), .move = move};
     }
+    zobrist_age();
+
+    pthread_t threads[MAX_THREADS];
+    int n_started = 1;
+    for (; n_started < n_threads; n_started++) {
+        negamax_worker_t *h = &workers[n_started];
+        h->board = b;
+        h->player = player;
+        h->stop = false;
+        if (pthread_create(&threads[n_started], NULL, helper_search, h))
+            break;
+    }
+
+    negamax_worker_t *w = &workers[0];
+    worker_reset(w, &b);
+    /* Deepen two plies at a time, ending on search_depth */
+    for (int depth = 2 - search_depth % 2; depth <= search_depth; depth += 2)
+        result = negamax(w, depth, player, -100000, 100000);
+
+    for (int i = 1; i < n_started; i++)
+        __atomic_store_n(&workers[i].stop, true, __ATOMIC_RELAXED);
+    for (int i = 1; i < n_started; i++)
+        pthread_join(threads[i], NULL);
     return result;
 }
+
+void negamax_set_threads(int threads)
+{
+    n_threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+void negamax_set_depth(int depth)
+{
+    search_depth = depth < 1 ? 1 : depth > N_GRIDS ? N_GRIDS : depth;
+}
+
+void negamax_set_pruning(bool lmr, bool futility)
+{
+    use_lmr = lmr;
+    use_futility = futility;
+}
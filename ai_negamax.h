@@ -1,6 +1,8 @@
 #ifndef AI_NEGAMAX_H
 #define AI_NEGAMAX_H
 
+#include <stdbool.h>
+
 typedef struct {
     int score;
     int move;
@@ -9,4 +11,18 @@ typedef struct {
 move_t negamax_predict(char *table, char player);
 void negamax_init(void);
 
+/* Number of threads searching each position, 1 by default. The others only
+ * help the first one through the shared transposition table.
+ */
+void negamax_set_threads(int threads);
+
+/* Plies searched for each move, 6 by default */
+void negamax_set_depth(int depth);
+
+/* Search late moves one ply shallower first, and skip moves near the horizon
+ * that cannot beat alpha. Both are off by default and let a deeper search
+ * fit the time of a shallower one.
+ */
+void negamax_set_pruning(bool lmr, bool futility);
+
 #endif
\ No newline at end of file
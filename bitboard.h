@@ -0,0 +1,256 @@
+#pragma once
+
+/* Bitboard view of the game shared by the kernel module and the userspace
+ * engines: one bit per cell and one mask per player, so placing a stone,
+ * testing for a win and walking the empty cells are a few AND/compare/ctz
+ * operations instead of scans over the char table.
+ */
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/types.h>
+#define bb_popcount(x) hweight32(x)
+#else
+#include <stdint.h>
+#define bb_popcount(x) __builtin_popcount(x)
+#endif
+
+#include "game.h"
+
+#if N_GRIDS <= 16
+typedef uint16_t bitboard_t;
+#else
+typedef uint32_t bitboard_t;
+#endif
+
+#define BB_CELL(x) ((bitboard_t) (1U << (x)))
+#define BB_FULL ((bitboard_t) ((1ULL << N_GRIDS) - 1))
+
+/* Number of GOAL-long segments visited when walking lines[] */
+#define N_LINE_SEGMENTS                         \
+    (2 * BOARD_SIZE * (BOARD_SIZE - GOAL + 1) + \
+     2 * (BOARD_SIZE - GOAL + 1) * (BOARD_SIZE - GOAL + 1))
+
+typedef struct {
+    bitboard_t line; /* the GOAL cells of the segment */
+    bitboard_t ends; /* cells that would overextend it, 0 if exceeding is ok */
+} line_mask_t;
+
+/* bits[0] holds the 'O' stones and bits[1] the 'X' ones, the same order as
+ * zobrist_table uses.
+ */
+typedef struct {
+    bitboard_t bits[2];
+} board_t;
+
+#define PLAYER_INDEX(p) ((p) == 'X')
+
+/* A cell lies on at most GOAL segments per direction */
+#define MAX_CELL_SEGMENTS (4 * GOAL)
+
+extern line_mask_t line_masks[N_LINE_SEGMENTS];
+extern int line_scores[GOAL + 1];
+
+/* The segments passing through each cell, so that a move only has to look
+ * at the lines it can have completed.
+ */
+extern line_mask_t cell_line_masks[N_GRIDS][MAX_CELL_SEGMENTS];
+extern uint8_t cell_line_ids[N_GRIDS][MAX_CELL_SEGMENTS];
+extern int n_cell_lines[N_GRIDS];
+
+/* The rotations and reflections of the board. Lines map onto lines, so every
+ * image of a position has the same value, and the engines share what they
+ * learn about one image with all of them through its canonical form.
+ */
+#define N_SYMMETRIES 8
+#define BB_BYTES ((N_GRIDS + 7) / 8)
+
+/* sym_cells[s][i] is where symmetry s takes cell i, sym_inverse[s] undoes
+ * s, and sym_bytes[s][k] holds the image under s of every value of byte k
+ * of a bitboard.
+ */
+extern uint8_t sym_cells[N_SYMMETRIES][N_GRIDS];
+extern uint8_t sym_inverse[N_SYMMETRIES];
+extern bitboard_t sym_bytes[N_SYMMETRIES][BB_BYTES][256];
+
+void bitboard_init(void);
+
+/* Iterate over the set bits of mask from the lowest cell upwards */
+#define bitboard_for_each(i, mask)                   \
+    for (bitboard_t __bits = (mask);                 \
+         __bits && ((i) = __builtin_ctz(__bits), 1); \
+         __bits &= __bits - 1)
+
+static inline int bitboard_nth(bitboard_t mask, int n)
+{
+    while (n--)
+        mask &= mask - 1;
+    return __builtin_ctz(mask);
+}
+
+static inline int bitboard_has_win(bitboard_t bits)
+{
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        bitboard_t line = line_masks[i].line;
+        if ((bits & line) == line && !(bits & line_masks[i].ends))
+            return 1;
+    }
+    return 0;
+}
+
+/* Fill cell_line_masks[] from line_masks[], called by bitboard_init() */
+static inline void bitboard_index_cells(void)
+{
+    for (int i = 0; i < N_GRIDS; i++)
+        n_cell_lines[i] = 0;
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        int cell;
+        bitboard_for_each(cell, line_masks[i].line) {
+            cell_line_ids[cell][n_cell_lines[cell]] = i;
+            cell_line_masks[cell][n_cell_lines[cell]++] = line_masks[i];
+        }
+    }
+}
+
+/* Whether the stone just added at move gives bits a winning line. Only the
+ * segments through move can have changed, provided the position was not
+ * already decided before the move.
+ */
+static inline int bitboard_wins_at(bitboard_t bits, int move)
+{
+    const line_mask_t *l = cell_line_masks[move];
+    for (int i = 0; i < n_cell_lines[move]; i++) {
+        if ((bits & l[i].line) == l[i].line && !(bits & l[i].ends))
+            return 1;
+    }
+    return 0;
+}
+
+/* Fill the sym_* tables, called by bitboard_init(). Symmetry s flips the
+ * columns if bit 0 is set, then the rows if bit 1 is, then swaps rows and
+ * columns if bit 2 is, so 0 is the identity.
+ */
+static inline void bitboard_index_symmetries(void)
+{
+    for (int s = 0; s < N_SYMMETRIES; s++) {
+        for (int i = 0; i < N_GRIDS; i++) {
+            int row = GET_ROW(i), col = GET_COL(i);
+            if (s & 1)
+                col = BOARD_SIZE - 1 - col;
+            if (s & 2)
+                row = BOARD_SIZE - 1 - row;
+            sym_cells[s][i] = s & 4 ? GET_INDEX(col, row) : GET_INDEX(row, col);
+        }
+    }
+    for (int s = 0; s < N_SYMMETRIES; s++) {
+        for (int t = 0; t < N_SYMMETRIES; t++) {
+            int i = 0;
+            while (i < N_GRIDS && sym_cells[t][sym_cells[s][i]] == i)
+                i++;
+            if (i == N_GRIDS)
+                sym_inverse[s] = t;
+        }
+        for (int k = 0; k < BB_BYTES; k++) {
+            for (int v = 0; v < 256; v++) {
+                bitboard_t image = 0;
+                for (int i = 0; i < 8 && 8 * k + i < N_GRIDS; i++) {
+                    if (v & (1 << i))
+                        image |= BB_CELL(sym_cells[s][8 * k + i]);
+                }
+                sym_bytes[s][k][v] = image;
+            }
+        }
+    }
+}
+
+static inline bitboard_t bitboard_transform(bitboard_t bits, int s)
+{
+    bitboard_t image = 0;
+    for (int k = 0; k < BB_BYTES; k++, bits >>= 8)
+        image |= sym_bytes[s][k][bits & 0xff];
+    return image;
+}
+
+/* Where symmetry s takes move, which may be -1 for none */
+static inline int bitboard_transform_move(int move, int s)
+{
+    return move < 0 ? move : sym_cells[s][move];
+}
+
+/* Replace b by its canonical form, the image with the smallest bits, and
+ * return the symmetry taking b there. Moves found on the canonical form go
+ * back through sym_inverse[] of it.
+ */
+static inline int board_canonical(board_t *b)
+{
+    board_t best = *b;
+    int best_s = 0;
+    for (int s = 1; s < N_SYMMETRIES; s++) {
+        board_t image = {{bitboard_transform(b->bits[0], s),
+                          bitboard_transform(b->bits[1], s)}};
+        if (image.bits[0] < best.bits[0] ||
+            (image.bits[0] == best.bits[0] && image.bits[1] < best.bits[1])) {
+            best = image;
+            best_s = s;
+        }
+    }
+    *b = best;
+    return best_s;
+}
+
+static inline void board_from_table(board_t *b, const char *table)
+{
+    b->bits[0] = b->bits[1] = 0;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (table[i] == 'O')
+            b->bits[0] |= BB_CELL(i);
+        else if (table[i] == 'X')
+            b->bits[1] |= BB_CELL(i);
+    }
+}
+
+static inline bitboard_t board_empty(const board_t *b)
+{
+    return BB_FULL & ~(b->bits[0] | b->bits[1]);
+}
+
+static inline void board_play(board_t *b, int move, char player)
+{
+    b->bits[PLAYER_INDEX(player)] |= BB_CELL(move);
+}
+
+static inline void board_undo(board_t *b, int move, char player)
+{
+    b->bits[PLAYER_INDEX(player)] &= ~BB_CELL(move);
+}
+
+/* Store the empty cells of b into moves[], which must hold N_GRIDS entries,
+ * in ascending order and return how many there are.
+ */
+static inline int board_moves(const board_t *b, int *moves)
+{
+    int n_moves = 0, move;
+    bitboard_for_each(move, board_empty(b))
+        moves[n_moves++] = move;
+    return n_moves;
+}
+
+/* Same contract as check_win(): the winner, 'D' on a full board, or ' ' */
+static inline char board_check_win(const board_t *b)
+{
+    if (bitboard_has_win(b->bits[0]))
+        return 'O';
+    if (bitboard_has_win(b->bits[1]))
+        return 'X';
+    return board_empty(b) ? ' ' : 'D';
+}
+
+/* check_win() for a position that was undecided before player took move */
+static inline char board_check_win_after(const board_t *b,
+                                         int move,
+                                         char player)
+{
+    if (bitboard_wins_at(b->bits[PLAYER_INDEX(player)], move))
+        return player;
+    return board_empty(b) ? ' ' : 'D';
+}
@@ -1,8 +1,6 @@
-#include <linux/slab.h>
-
+#include "bitboard.h"
 #include "game.h"
 
-
 const line_t lines[4] = {
     {1, 0, 0, 0, BOARD_SIZE - GOAL + 1, BOARD_SIZE},             // ROW
     {0, 1, 0, 0, BOARD_SIZE, BOARD_SIZE - GOAL + 1},             // COL
@@ -10,41 +8,59 @@ const line_t lines[4] = {
     {1, -1, 0, GOAL - 1, BOARD_SIZE - GOAL + 1, BOARD_SIZE},     // SECONDARY
 };
 
-static char check_line_segment_win(const char *t, int i, int j, line_t line)
-{
-    char last = t[GET_INDEX(i, j)];
-    if (last == ' ')
-        return ' ';
-    for (int k = 1; k < GOAL; k++) {
-        if (last != t[GET_INDEX(i + k * line.i_shift, j + k * line.j_shift)])
-            return ' ';
-    }
+line_mask_t line_masks[N_LINE_SEGMENTS];
+int line_scores[GOAL + 1];
+line_mask_t cell_line_masks[N_GRIDS][MAX_CELL_SEGMENTS];
+uint8_t cell_line_ids[N_GRIDS][MAX_CELL_SEGMENTS];
+int n_cell_lines[N_GRIDS];
+uint8_t sym_cells[N_SYMMETRIES][N_GRIDS];
+uint8_t sym_inverse[N_SYMMETRIES];
+bitboard_t sym_bytes[N_SYMMETRIES][BB_BYTES][256];
 
-#if !ALLOW_EXCEED
-    if (last == LOOKUP(t, i - line.i_shift, j - line.j_shift, ' ') ||
-        last ==
-            LOOKUP(t, i + GOAL * line.i_shift, j + GOAL * line.j_shift, ' '))
-        return ' ';
-#endif
-    return last;
+static bitboard_t cell_mask(int i, int j)
+{
+    if (i < 0 || i >= BOARD_SIZE || j < 0 || j >= BOARD_SIZE)
+        return 0;
+    return BB_CELL(GET_INDEX(i, j));
 }
 
-char check_win(const char *t)
+void bitboard_init(void)
 {
+    int n = 0;
     for (int i_line = 0; i_line < 4; ++i_line) {
         line_t line = lines[i_line];
         for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
             for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
-                char win = check_line_segment_win(t, i, j, line);
-                if (win != ' ')
-                    return win;
+                bitboard_t mask = 0;
+                for (int k = 0; k < GOAL; k++)
+                    mask |= cell_mask(i + k * line.i_shift,
+                                      j + k * line.j_shift);
+                line_masks[n].line = mask;
+#if ALLOW_EXCEED
+                line_masks[n].ends = 0;
+#else
+                line_masks[n].ends =
+                    cell_mask(i - line.i_shift, j - line.j_shift) |
+                    cell_mask(i + GOAL * line.i_shift,
+                              j + GOAL * line.j_shift);
+#endif
+                n++;
             }
         }
     }
-    for (int i = 0; i < N_GRIDS; i++)
-        if (t[i] == ' ')
-            return ' ';
-    return 'D';
+    bitboard_index_cells();
+    bitboard_index_symmetries();
+
+    line_scores[0] = 0;
+    for (int k = 1, score = 1; k <= GOAL; k++, score *= 10)
+        line_scores[k] = score;
+}
+
+char check_win(const char *t)
+{
+    board_t b;
+    board_from_table(&b, t);
+    return board_check_win(&b);
 }
 
 fixed_point_t calculate_win_value(char win, char player)
@@ -56,14 +72,9 @@ fixed_point_t calculate_win_value(char win, char player)
     return 1U << (FIXED_SCALE_BITS - 1);
 }
 
-int *available_moves(const char *table)
+int available_moves(const char *table, int *moves)
 {
-    int *moves = kzalloc(N_GRIDS * sizeof(int), GFP_KERNEL);
-    int m = 0;
-    for (int i = 0; i < N_GRIDS; i++)
-        if (table[i] == ' ')
-            moves[m++] = i;
-    if (m < N_GRIDS)
-        moves[m] = -1;
-    return moves;
+    board_t b;
+    board_from_table(&b, table);
+    return board_moves(&b, moves);
 }
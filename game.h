@@ -34,6 +34,7 @@ typedef unsigned fixed_point_t;
 
 extern const line_t lines[4];
 
-int *available_moves(const char *table);
+/* moves must have room for N_GRIDS entries; returns the number stored */
+int available_moves(const char *table, int *moves);
 char check_win(const char *t);
 fixed_point_t calculate_win_value(char win, char player);
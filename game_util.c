@@ -1,14 +1,9 @@
 #include "game_util.h"
 #include <stdlib.h>
 #include <string.h>
+#include "bitboard.h"
 
-#define GET_INDEX(i, j) ((i) * UTIL_BOARD_SIZE + (j))
-#define LOOKUP(t, i, j, def)                                                  \
-    (((i) < 0 || (i) >= UTIL_BOARD_SIZE || (j) < 0 || (j) >= UTIL_BOARD_SIZE) \
-         ? def                                                                \
-         : (t)[GET_INDEX(i, j)])
-
-const util_line_t lines[4] = {
+const line_t lines[4] = {
     {1, 0, 0, 0, UTIL_BOARD_SIZE - UTIL_GOAL + 1, UTIL_BOARD_SIZE},
     {0, 1, 0, 0, UTIL_BOARD_SIZE, UTIL_BOARD_SIZE - UTIL_GOAL + 1},
     {1, 1, 0, 0, UTIL_BOARD_SIZE - UTIL_GOAL + 1,
@@ -16,41 +11,58 @@ const util_line_t lines[4] = {
     {1, -1, 0, UTIL_GOAL - 1, UTIL_BOARD_SIZE - UTIL_GOAL + 1, UTIL_BOARD_SIZE},
 };
 
-static char check_line_segment_win(const char *t,
-                                   int i,
-                                   int j,
-                                   util_line_t line)
+line_mask_t line_masks[N_LINE_SEGMENTS];
+int line_scores[GOAL + 1];
+line_mask_t cell_line_masks[N_GRIDS][MAX_CELL_SEGMENTS];
+uint8_t cell_line_ids[N_GRIDS][MAX_CELL_SEGMENTS];
+int n_cell_lines[N_GRIDS];
+uint8_t sym_cells[N_SYMMETRIES][N_GRIDS];
+uint8_t sym_inverse[N_SYMMETRIES];
+bitboard_t sym_bytes[N_SYMMETRIES][BB_BYTES][256];
+
+static bitboard_t cell_mask(int i, int j)
 {
-    char last = t[GET_INDEX(i, j)];
-    if (last == ' ')
-        return ' ';
-    for (int k = 1; k < UTIL_GOAL; k++) {
-        if (last != t[GET_INDEX(i + k * line.i_shift, j + k * line.j_shift)])
-            return ' ';
-    }
-    if (last == LOOKUP(t, i - line.i_shift, j - line.j_shift, ' ') ||
-        last == LOOKUP(t, i + UTIL_GOAL * line.i_shift,
-                       j + UTIL_GOAL * line.j_shift, ' '))
-        return ' ';
-    return last;
+    if (i < 0 || i >= UTIL_BOARD_SIZE || j < 0 || j >= UTIL_BOARD_SIZE)
+        return 0;
+    return BB_CELL(GET_INDEX(i, j));
 }
 
-char check_win(const char *t)
+/* Unlike the kernel module, a line longer than UTIL_GOAL is not a win here,
+ * so every segment carries the cells just past both of its ends.
+ */
+void bitboard_init(void)
 {
+    int n = 0;
     for (int i_line = 0; i_line < 4; ++i_line) {
-        util_line_t line = lines[i_line];
+        line_t line = lines[i_line];
         for (int i = line.i_lower_bound; i < line.i_upper_bound; ++i) {
             for (int j = line.j_lower_bound; j < line.j_upper_bound; ++j) {
-                char win = check_line_segment_win(t, i, j, line);
-                if (win != ' ')
-                    return win;
+                bitboard_t mask = 0;
+                for (int k = 0; k < UTIL_GOAL; k++)
+                    mask |= cell_mask(i + k * line.i_shift,
+                                      j + k * line.j_shift);
+                line_masks[n].line = mask;
+                line_masks[n].ends =
+                    cell_mask(i - line.i_shift, j - line.j_shift) |
+                    cell_mask(i + UTIL_GOAL * line.i_shift,
+                              j + UTIL_GOAL * line.j_shift);
+                n++;
             }
         }
     }
-    for (int i = 0; i < UTIL_N_GRIDS; i++)
-        if (t[i] == ' ')
-            return ' ';
-    return 'D';
+    bitboard_index_cells();
+    bitboard_index_symmetries();
+
+    line_scores[0] = 0;
+    for (int k = 1, score = 1; k <= UTIL_GOAL; k++, score *= 10)
+        line_scores[k] = score;
+}
+
+char check_win(const char *t)
+{
+    board_t b;
+    board_from_table(&b, t);
+    return board_check_win(&b);
 }
 
 util_fixed_point_t calculate_win_value(char win, char player)
@@ -62,14 +74,9 @@ util_fixed_point_t calculate_win_value(char win, char player)
     return 1U << (UTIL_FIXED_SCALE_BITS - 1);
 }
 
-int *available_moves(const char *table)
+int available_moves(const char *table, int *moves)
 {
-    int *moves = calloc(UTIL_N_GRIDS + 1, sizeof(int));
-    int m = 0;
-    for (int i = 0; i < UTIL_N_GRIDS; i++) {
-        if (table[i] == ' ')
-            moves[m++] = i;
-    }
-    moves[m] = -1;
-    return moves;
-}
\ No newline at end of file
+    board_t b;
+    board_from_table(&b, table);
+    return board_moves(&b, moves);
+}
@@ -14,17 +14,10 @@ typedef struct {
 
 typedef unsigned util_fixed_point_t;
 
-typedef struct {
-    int i_shift;
-    int j_shift;
-    int i_lower_bound;
-    int j_lower_bound;
-    int i_upper_bound;
-    int j_upper_bound;
-} util_line_t;
-
+void bitboard_init(void);
 char check_win(const char *t);
 util_fixed_point_t calculate_win_value(char win, char player);
-int *available_moves(const char *t);
+/* moves must have room for UTIL_N_GRIDS entries; returns the count */
+int available_moves(const char *t, int *moves);
 
 #endif
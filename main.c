@@ -5,9 +5,12 @@
 #include <linux/interrupt.h>
 #include <linux/kfifo.h>
 #include <linux/module.h>
+#include <linux/poll.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/sysfs.h>
 #include <linux/version.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 #if defined(CONFIG_X86)
 #include <linux/vmalloc.h>
@@ -16,6 +19,7 @@
 #include "game.h"
 #include "mcts.h"
 #include "negamax.h"
+#include "tablebase.h"
 #include "xo_common.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
@@ -34,8 +38,6 @@ MODULE_DESCRIPTION("In-kernel Tic-Tac-Toe game engine");
 #define NR_KMLDRV 1
 
 static int delay = 100; /* time (in ms) to generate an event */
-static struct xo_board last_board;
-static struct xo_result last_result;
 
 /* Declare kernel module attribute for sysfs */
 
@@ -92,14 +94,6 @@ static DECLARE_KFIFO_PTR(rx_fifo, unsigned char);
  */
 static DEFINE_MUTEX(read_lock);
 
-static DEFINE_MUTEX(kxo_lock);
-
-/* Wait queue to implement blocking I/O from userspace */
-static DECLARE_WAIT_QUEUE_HEAD(rx_wait);
-
-/* Mutex to serialize kfifo writers within the workqueue handler */
-static DEFINE_MUTEX(producer_lock);
-
 /* Mutex to serialize fast_buf consumers: we can use a mutex because consumers
  * run in workqueue handler (kernel thread context).
  */
@@ -110,129 +104,123 @@ static DEFINE_MUTEX(consumer_lock);
  */
 static struct circ_buf fast_buf;
 
-static char table[N_GRIDS];
-
 /* Clear all data from the circular buffer fast_buf */
 static void fast_buf_clear(void)
 {
     fast_buf.head = fast_buf.tail = 0;
 }
 
-static char turn;
-static int finish;
-
-static void ai_one_work_func(struct work_struct *w)
-{
-    ktime_t tv_start, tv_end;
-    s64 nsecs;
-
-    int cpu;
+/* Requests a client may have written and not read the result of yet */
+#define KXO_MAX_REQUESTS 16
 
-    WARN_ON_ONCE(in_softirq());
-    WARN_ON_ONCE(in_interrupt());
-
-    cpu = get_cpu();
-    pr_info("kxo: [CPU#%d] start doing %s\n", cpu, __func__);
-    tv_start = ktime_get();
-    mutex_lock(&producer_lock);
-    int move;
-    WRITE_ONCE(move, mcts(table, 'O'));
-
-    smp_mb();
-
-    if (move != -1)
-        WRITE_ONCE(table[move], 'O');
-
-    WRITE_ONCE(turn, 'X');
-    WRITE_ONCE(finish, 1);
-    smp_wmb();
-    mutex_unlock(&producer_lock);
-    tv_end = ktime_get();
+/* State of one open file. write() queues a request and returns, a work item
+ * searches the requests of the client one after another with the engines of
+ * the client, and read() and poll() wait for the results, which come back in
+ * the same order with the id of their request. Clients search in parallel and
+ * each one only ever reads its own results.
+ */
+struct kxo_session {
+    spinlock_t lock; /* protects the fifos and n_requests */
+    DECLARE_KFIFO(requests, struct xo_board, KXO_MAX_REQUESTS);
+    DECLARE_KFIFO(results, struct xo_result, KXO_MAX_REQUESTS);
+    unsigned int n_requests; /* written and not read back */
+    wait_queue_head_t wait;  /* for a result, or for room for a request */
+    struct work_struct work;
+    /* orders the writers, which allocate the engines the work then uses */
+    struct mutex write_lock;
+    /* orders the readers, so a result stays queued until it is copied out */
+    struct mutex read_lock;
+    struct mcts_ctx *mcts;       /* allocated by the first request for 'O' */
+    struct negamax_ctx *negamax; /* and for 'X' */
+};
 
-    nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
-    pr_info("kxo: [CPU#%d] doing %s for %llu usec\n", cpu, __func__,
-            (unsigned long long) nsecs >> 10);
-    put_cpu();
+static void kxo_search_work(struct work_struct *work)
+{
+    struct kxo_session *s = container_of(work, struct kxo_session, work);
+    struct xo_board board;
+    bool found;
+
+    for (;;) {
+        spin_lock(&s->lock);
+        found = kfifo_get(&s->requests, &board);
+        spin_unlock(&s->lock);
+        if (!found)
+            break;
+
+        struct xo_result result = {.id = board.id};
+        ktime_t tv_start = ktime_get();
+        if (board.player == 'O') {
+            result.move = mcts(s->mcts, board.table, 'O', board.budget_us,
+                               &result.iterations);
+        } else {
+            result.move = negamax_predict(s->negamax, board.table, 'X').move;
+            result.iterations = 0;
+        }
+
+        /* Every request of every client gets here, so only on demand */
+        pr_debug("kxo: player %c chose move %d in %lld usec\n", board.player,
+                 result.move, ktime_us_delta(ktime_get(), tv_start));
+
+        /* n_requests keeps room for every result */
+        spin_lock(&s->lock);
+        kfifo_put(&s->results, result);
+        spin_unlock(&s->lock);
+        wake_up_interruptible(&s->wait);
+    }
 }
 
-static void ai_two_work_func(struct work_struct *w)
+static bool kxo_request_room(struct kxo_session *s)
 {
-    ktime_t tv_start, tv_end;
-    s64 nsecs;
-
-    int cpu;
-
-    WARN_ON_ONCE(in_softirq());
-    WARN_ON_ONCE(in_interrupt());
-
-    cpu = get_cpu();
-    pr_info("kxo: [CPU#%d] start doing %s\n", cpu, __func__);
-    tv_start = ktime_get();
-    mutex_lock(&producer_lock);
-    int move;
-    WRITE_ONCE(move, negamax_predict(table, 'X').move);
-
-    smp_mb();
-
-    if (move != -1)
-        WRITE_ONCE(table[move], 'X');
-
-    WRITE_ONCE(turn, 'O');
-    WRITE_ONCE(finish, 1);
-    smp_wmb();
-    mutex_unlock(&producer_lock);
-    tv_end = ktime_get();
-
-    nsecs = (s64) ktime_to_ns(ktime_sub(tv_end, tv_start));
-    pr_info("kxo: [CPU#%d] end doing %s for %llu usec\n", cpu, __func__,
-            (unsigned long long) nsecs >> 10);
-    put_cpu();
+    return READ_ONCE(s->n_requests) < KXO_MAX_REQUESTS;
 }
 
-/* Work item: holds a pointer to the function that is going to be executed
- * asynchronously.
- */
-static DECLARE_WORK(ai_one_work, ai_one_work_func);
-static DECLARE_WORK(ai_two_work, ai_two_work_func);
-
 static ssize_t kxo_write(struct file *file,
                          const char __user *buf,
                          size_t len,
                          loff_t *off)
 {
-    if (mutex_lock_interruptible(&kxo_lock))
-        return -ERESTARTSYS;
-    printk(KERN_INFO "kxo_write: len=%zu expect=%zu\n", len,
-           sizeof(struct xo_board));
+    struct kxo_session *s = file->private_data;
+    struct xo_board board;
+    int ret = 0;
+
     if (len != sizeof(struct xo_board))
         return -EINVAL;
-    if (copy_from_user(&last_board, buf, sizeof(struct xo_board)))
+    if (copy_from_user(&board, buf, sizeof(struct xo_board)))
         return -EFAULT;
-
-    int move;
-    if (last_board.player == 'O') {
-        printk(KERN_INFO "Player O using MCTS algorithm\n");
-        move = mcts(last_board.table, 'O');
-    } else if (last_board.player == 'X') {
-        printk(KERN_INFO "Player X using Negamax algorithm\n");
-        move = negamax_predict(last_board.table, 'X').move;
-    } else {
-        printk(KERN_ERR "Invalid player: %c\n", last_board.player);
-        printk(KERN_ERR "Invalid player: %c\n", last_board.player);
+    if (board.player != 'O' && board.player != 'X') {
+        pr_debug("kxo: invalid player %c\n", board.player);
         return -EINVAL;
     }
 
-    if (move != -1) {
-        printk(KERN_INFO "Player %c chose move: %d\n", last_board.player, move);
-        last_board.table[move] = last_board.player;
-    } else {
-        printk(KERN_ERR "Invalid move selected: %d\n", move);
+    if (mutex_lock_interruptible(&s->write_lock))
+        return -ERESTARTSYS;
+    if (board.player == 'O' && !s->mcts)
+        s->mcts = mcts_ctx_alloc();
+    else if (board.player == 'X' && !s->negamax)
+        s->negamax = negamax_ctx_alloc();
+    if (board.player == 'O' ? !s->mcts : !s->negamax) {
+        ret = -ENOMEM;
+        goto out;
     }
-
-    last_result.move = move;
-
-    mutex_unlock(&kxo_lock);
-    return sizeof(struct xo_board);
+    /* Only writers add requests, so the room lasts until this one is in */
+    if (!kxo_request_room(s)) {
+        if (file->f_flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (wait_event_interruptible(s->wait, kxo_request_room(s))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+    }
+    spin_lock(&s->lock);
+    kfifo_put(&s->requests, board);
+    s->n_requests++;
+    spin_unlock(&s->lock);
+    queue_work(system_unbound_wq, &s->work);
+out:
+    mutex_unlock(&s->write_lock);
+    return ret ? ret : sizeof(struct xo_board);
 }
 
 static ssize_t kxo_read(struct file *file,
@@ -240,22 +228,97 @@ static ssize_t kxo_read(struct file *file,
                         size_t len,
                         loff_t *off)
 {
-    if (mutex_lock_interruptible(&kxo_lock))
-        return -ERESTARTSYS;
+    struct kxo_session *s = file->private_data;
+    struct xo_result result;
+    bool found;
+    int ret = 0;
+
     if (len != sizeof(struct xo_result))
         return -EINVAL;
-    if (copy_to_user(buf, &last_result, sizeof(struct xo_result)))
-        return -EFAULT;
-    mutex_unlock(&kxo_lock);
-    return sizeof(struct xo_result);
+    if (mutex_lock_interruptible(&s->read_lock))
+        return -ERESTARTSYS;
+    for (;;) {
+        spin_lock(&s->lock);
+        found = kfifo_peek(&s->results, &result);
+        spin_unlock(&s->lock);
+        if (found)
+            break;
+        if (file->f_flags & O_NONBLOCK) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        if (wait_event_interruptible(s->wait,
+                                     !kfifo_is_empty(&s->results))) {
+            ret = -ERESTARTSYS;
+            goto out;
+        }
+    }
+
+    /* A failed copy leaves the result for the next read */
+    if (copy_to_user(buf, &result, sizeof(struct xo_result))) {
+        ret = -EFAULT;
+        goto out;
+    }
+    spin_lock(&s->lock);
+    kfifo_skip(&s->results);
+    s->n_requests--;
+    spin_unlock(&s->lock);
+    wake_up_interruptible(&s->wait);
+out:
+    mutex_unlock(&s->read_lock);
+    return ret ? ret : sizeof(struct xo_result);
+}
+
+static __poll_t kxo_poll(struct file *file, poll_table *wait)
+{
+    struct kxo_session *s = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &s->wait, wait);
+    spin_lock(&s->lock);
+    if (!kfifo_is_empty(&s->results))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (s->n_requests < KXO_MAX_REQUESTS)
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    spin_unlock(&s->lock);
+    return mask;
 }
 
 static atomic_t open_cnt;
 
+/* Every client may allocate the trees of all MCTS workers, about 10 MB each
+ * with the default mcts_pool_size, so their number bounds the memory the
+ * module takes.
+ */
+static unsigned int max_clients = 16;
+module_param(max_clients, uint, 0644);
+MODULE_PARM_DESC(max_clients, "Maximum number of files of /dev/kxo open");
+
 static int kxo_open(struct inode *inode, struct file *filp)
 {
+    struct kxo_session *s = kzalloc(sizeof(*s), GFP_KERNEL);
+    int cnt;
+
     pr_debug("kxo: %s\n", __func__);
-    if (atomic_inc_return(&open_cnt) == 1)
+    if (!s)
+        return -ENOMEM;
+    /* Never count a client past the limit, which release() could miss */
+    cnt = atomic_read(&open_cnt);
+    do {
+        if (cnt >= READ_ONCE(max_clients)) {
+            kfree(s);
+            return -EBUSY;
+        }
+    } while (!atomic_try_cmpxchg(&open_cnt, &cnt, cnt + 1));
+    spin_lock_init(&s->lock);
+    INIT_KFIFO(s->requests);
+    INIT_KFIFO(s->results);
+    init_waitqueue_head(&s->wait);
+    INIT_WORK(&s->work, kxo_search_work);
+    mutex_init(&s->write_lock);
+    mutex_init(&s->read_lock);
+    filp->private_data = s;
+    if (cnt == 0)
         mod_timer(&timer, jiffies + msecs_to_jiffies(delay));
     pr_info("openm current cnt: %d\n", atomic_read(&open_cnt));
 
@@ -264,7 +327,17 @@ static int kxo_open(struct inode *inode, struct file *filp)
 
 static int kxo_release(struct inode *inode, struct file *filp)
 {
+    struct kxo_session *s = filp->private_data;
+
     pr_debug("kxo: %s\n", __func__);
+    /* Drop the requests not searched yet and wait for the one that is */
+    spin_lock(&s->lock);
+    kfifo_reset(&s->requests);
+    spin_unlock(&s->lock);
+    cancel_work_sync(&s->work);
+    mcts_ctx_free(s->mcts);
+    negamax_ctx_free(s->negamax);
+    kfree(s);
     if (atomic_dec_and_test(&open_cnt)) {
         del_timer_sync(&timer);
         fast_buf_clear();
@@ -277,6 +350,7 @@ static int kxo_release(struct inode *inode, struct file *filp)
 static const struct file_operations kxo_fops = {
     .read = kxo_read,
     .write = kxo_write,
+    .poll = kxo_poll,
     .llseek = no_llseek,
     .open = kxo_open,
     .release = kxo_release,
@@ -328,10 +402,27 @@ static int __init kxo_init(void)
         return ret;
     }
 
-    negamax_init();
-    mcts_init();
-    memset(table, ' ', N_GRIDS);
-
+    ret = tablebase_init(kxo_dev);
+    if (!ret) {
+        ret = negamax_init();
+        if (ret)
+            tablebase_exit();
+    }
+    if (!ret) {
+        ret = mcts_init();
+        if (ret) {
+            negamax_exit();
+            tablebase_exit();
+        }
+    }
+    if (ret) {
+        device_remove_file(kxo_dev, &dev_attr_kxo_state);
+        device_destroy(kxo_class, dev_id);
+        class_destroy(kxo_class);
+        cdev_del(&kxo_cdev);
+        unregister_chrdev_region(dev_id, NR_KMLDRV);
+        return ret;
+    }
     attr_obj.display = '1';
     attr_obj.resume = '1';
     attr_obj.end = '0';
@@ -355,6 +446,9 @@ static void __exit kxo_exit(void)
     unregister_chrdev_region(dev_id, NR_KMLDRV);
 
     kfifo_free(&rx_fifo);
+    mcts_exit();
+    negamax_exit();
+    tablebase_exit();
     pr_info("kxo: unloaded\n");
 }
 
@@ -1,218 +1,753 @@
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
+#include <linux/random.h>
 #include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
 
+#include "bitboard.h"
 #include "game.h"
 #include "mcts.h"
+#include "tablebase.h"
 #include "util.h"
+#include "zobrist.h"
 
+/* Game-theoretic value of a node, for the player who moved into it like the
+ * score. Once known it is exact, so selection skips the node.
+ */
+enum { UNPROVEN, PROVEN_WIN, PROVEN_LOSS, PROVEN_DRAW };
+
+/* With transpositions shared, the nodes form a DAG: every position has one
+ * node, whichever move order reaches it, and its statistics gather all of
+ * them. A search then updates the path it took instead of following parents.
+ * The tree then also holds positions in canonical form only, so the images
+ * of a position under the symmetries of the board share its node as well,
+ * and of the moves leading to images of one another only the first is kept.
+ */
 struct node {
-    int move;
+    u64 key;           /* Zobrist key of the position */
+    struct node *next; /* in the same transposition bucket */
     char player;
+    s8 proven;
+    u8 n_children;
     int n_visits;
     fixed_point_t score;
-    struct node *parent;
-    struct node *children[N_GRIDS];
+    struct node *children[N_GRIDS]; /* by move, NULL until expanded */
+};
+
+/* Search state of one client: a tree per worker, kept between its moves.
+ * workers[0] runs on the calling thread.
+ */
+struct mcts_ctx {
+    bool solved; /* set by the first worker to prove the root, stops the rest */
+    struct mcts_info workers[];
 };
 
-static struct mcts_info mcts_obj;
+static bool mcts_transpositions;
+module_param(mcts_transpositions, bool, 0444);
+MODULE_PARM_DESC(mcts_transpositions,
+                 "Share MCTS nodes between move orders and symmetries");
+
+/* Buckets of the transposition table of a worker, one per pool node */
+static unsigned int table_mask;
+
+/* Tree nodes come from one array per worker, allocated with its context. A
+ * search hands them out in order and gives them all back at once by resetting
+ * the counter, or by compacting the subtree it keeps for the next search to
+ * the front.
+ */
+static unsigned int mcts_pool_size = 1 << 16;
+module_param(mcts_pool_size, uint, 0444);
+MODULE_PARM_DESC(mcts_pool_size, "Maximum number of MCTS tree nodes");
+
+static int mcts_active_nodes;
+module_param(mcts_active_nodes, int, 0444);
+MODULE_PARM_DESC(mcts_active_nodes, "Tree nodes used by the last MCTS search");
+
+static unsigned int mcts_reuse_nodes = 1 << 15;
+module_param(mcts_reuse_nodes, uint, 0644);
+MODULE_PARM_DESC(mcts_reuse_nodes,
+                 "Maximum number of tree nodes kept between MCTS searches");
+
+/* Root parallelization: every worker grows its own tree from the same
+ * position with its own random stream and node pool, and the root visit
+ * counts are summed to pick the move. The ITERATIONS budget is split between
+ * the workers.
+ */
+static unsigned int mcts_workers = 1;
+module_param(mcts_workers, uint, 0444);
+MODULE_PARM_DESC(mcts_workers, "Number of CPUs running MCTS in parallel");
+
+#define MAX_BATCH 64U
+
+static unsigned int mcts_batch = 1;
+module_param(mcts_batch, uint, 0644);
+MODULE_PARM_DESC(mcts_batch, "Playouts averaged for each new MCTS leaf");
+
+/* With a time budget a search runs until its deadline instead of for
+ * ITERATIONS, reading the clock every DEADLINE_CHECK_INTERVAL iterations.
+ */
+#define DEADLINE_CHECK_INTERVAL 256
+#define MAX_BUDGET_US 1000000U
+
+/* An untimed search looks as often whether its move is already settled */
+#define EARLY_STOP_INTERVAL 64
+
+/* Statistics, updated by clients searching at the same time */
+static DEFINE_SPINLOCK(mcts_stats_lock);
+
+static unsigned long mcts_saved_iterations;
+module_param(mcts_saved_iterations, ulong, 0444);
+MODULE_PARM_DESC(mcts_saved_iterations,
+                 "MCTS iterations skipped because the move was settled");
+
+static unsigned int mcts_budget_us;
+module_param(mcts_budget_us, uint, 0644);
+MODULE_PARM_DESC(mcts_budget_us,
+                 "MCTS time budget per move in usec, 0 to run ITERATIONS");
+
+/* Every worker owns a random stream, started a long jump after the one handed
+ * out before it, so playouts draw from it without locking or jumping.
+ */
+static struct state_array mcts_streams;
+static DEFINE_SPINLOCK(mcts_streams_lock);
+
+static unsigned long long mcts_seed;
+module_param(mcts_seed, ullong, 0444);
+MODULE_PARM_DESC(mcts_seed,
+                 "Seed of the MCTS random streams, 0 to pick a random one");
+
+static void table_insert(struct mcts_info *m, struct node *node)
+{
+    struct node **bucket = &m->table[node->key & table_mask];
+    node->next = *bucket;
+    *bucket = node;
+}
 
-static struct node *new_node(int move, char player, struct node *parent)
+static struct node *table_find(const struct mcts_info *m, u64 key)
 {
-    struct node *node = kzalloc(sizeof(struct node), GFP_KERNEL);
-    node->move = move;
+    struct node *node = m->table[key & table_mask];
+    while (node && node->key != key)
+        node = node->next;
+    return node;
+}
+
+static struct node *new_node(struct mcts_info *m, u64 key, char player)
+{
+    struct node *node = &m->pool[m->nr_active_nodes++];
+    node->key = key;
     node->player = player;
+    node->proven = UNPROVEN;
+    node->n_children = 0;
     node->n_visits = 0;
     node->score = 0;
-    node->parent = parent;
     memset(node->children, 0, sizeof(node->children));
+    if (m->table)
+        table_insert(m, node);
     return node;
 }
 
-static void free_node(struct node *node)
-{
-    for (int i = 0; i < N_GRIDS; i++)
-        if (node->children[i])
-            free_node(node->children[i]);
-    kfree(node);
-}
+/* The UCT terms only depend on visit counts, so they are tabulated once by
+ * mcts_init() and selection is left with two multiplications per child.
+ * uct_explore[N] holds C * sqrt(ln N) with C = sqrt(2) in fixed point,
+ * uct_inv[n] holds 1/n and 1/sqrt(n) scaled by 2^UCT_INV_BITS. The few nodes
+ * near the root of a long or reused search that outgrow the tables have their
+ * terms computed on the spot.
+ */
+#define UCT_TABLE_SIZE (2 * ITERATIONS + 1)
+#define UCT_INV_BITS 24
+#define LN2_FIXED16 45426 /* ln(2) * 2^16 */
 
-static fixed_point_t fixed_sqrt(fixed_point_t x)
-{
-    if (!x || x == (1U << FIXED_SCALE_BITS))
-        return x;
+struct uct_inv {
+    u32 inv, inv_sqrt;
+};
 
-    fixed_point_t s = 0U;
-    for (int i = (31 - __builtin_clz(x | 1)); i >= 0; i--) {
-        fixed_point_t t = (1U << i);
-        if ((((s + t) * (s + t)) >> FIXED_SCALE_BITS) <= x)
-            s += t;
-    }
-    return s;
-}
+static fixed_point_t *uct_explore;
+static struct uct_inv *uct_inv;
 
-static fixed_point_t fixed_log(fixed_point_t v)
+/* log2(x) with 16 fractional bits, x >= 1 */
+static u32 log2_fixed16(u32 x)
 {
-    if (!v || v == (1U << FIXED_SCALE_BITS))
-        return 0;
-
-    fixed_point_t numerator = (v - (1U << FIXED_SCALE_BITS));
-    int neg = 0;
-    if (GET_SIGN(numerator)) {
-        neg = 1;
-        numerator = CLR_SIGN(numerator);
-        numerator = (1U << 31) - numerator;
+    int msb = fls(x) - 1;
+    u64 y = ((u64) x << 30) >> msb; /* x / 2^msb in [1, 2), 30 bits */
+    u32 result = msb << 16;
+    for (int i = 15; i >= 0; i--) {
+        y = (y * y) >> 30;
+        if (y >= (2ULL << 30)) {
+            y >>= 1;
+            result |= 1U << i;
+        }
     }
+    return result;
+}
 
-    fixed_point_t y =
-        (numerator << FIXED_SCALE_BITS) / (v + (1U << FIXED_SCALE_BITS));
+/* n >= 1 */
+static fixed_point_t uct_explore_of(u32 n)
+{
+    u64 ln = ((u64) log2_fixed16(n) * LN2_FIXED16) >> 16;
+    /* sqrt(2 * ln / 2^16) scaled by 2^FIXED_SCALE_BITS */
+    return int_sqrt64((2 * ln << (2 * FIXED_SCALE_BITS)) >> 16);
+}
 
-    fixed_point_t ans = 0U;
-    for (unsigned i = 1; i < 20; i += 2) {
-        fixed_point_t z = (1U << FIXED_SCALE_BITS);
-        for (int j = 0; j < i; j++) {
-            z *= y;
-            z >>= FIXED_SCALE_BITS;
-        }
-        z <<= FIXED_SCALE_BITS;
-        z /= (i << FIXED_SCALE_BITS);
+static struct uct_inv uct_inv_of(u32 n)
+{
+    struct uct_inv t = {
+        .inv = (1U << UCT_INV_BITS) / n,
+        .inv_sqrt = int_sqrt64((1ULL << (2 * UCT_INV_BITS)) / n),
+    };
+    return t;
+}
 
-        ans += z;
+static void uct_tables_init(void)
+{
+    uct_explore[0] = 0;
+    uct_inv[0].inv = uct_inv[0].inv_sqrt = 0;
+    for (u32 n = 1; n < UCT_TABLE_SIZE; n++) {
+        uct_explore[n] = uct_explore_of(n);
+        uct_inv[n] = uct_inv_of(n);
     }
-    ans <<= 1;
-    ans = neg ? SET_SIGN(ans) : ans;
-    return ans;
 }
 
-#define EXPLORATION_FACTOR fixed_sqrt(1U << (FIXED_SCALE_BITS + 1))
+static inline fixed_point_t uct_explore_at(int n_visits)
+{
+    if (likely(n_visits < UCT_TABLE_SIZE))
+        return uct_explore[n_visits];
+    return uct_explore_of(n_visits);
+}
 
-static inline fixed_point_t uct_score(int n_total,
+static inline fixed_point_t uct_score(fixed_point_t explore,
                                       int n_visits,
                                       fixed_point_t score)
 {
     if (n_visits == 0)
         return FIXED_MAX;
 
-    fixed_point_t result =
-        score << FIXED_SCALE_BITS /
-                     (fixed_point_t) (n_visits << FIXED_SCALE_BITS);
-    fixed_point_t tmp =
-        EXPLORATION_FACTOR *
-        fixed_sqrt(fixed_log(n_total << FIXED_SCALE_BITS) / n_visits);
-    tmp >>= FIXED_SCALE_BITS;
-    return result + tmp;
+    struct uct_inv t = likely(n_visits < UCT_TABLE_SIZE)
+                           ? uct_inv[n_visits]
+                           : uct_inv_of(n_visits);
+    return (((u64) score * t.inv) >> UCT_INV_BITS) +
+           (((u64) explore * t.inv_sqrt) >> UCT_INV_BITS);
 }
 
-static struct node *select_move(struct node *node)
+/* Returns the move to the child to descend to, or -1 when node is settled
+ * because its replies have been proven, possibly through another parent.
+ */
+static int select_move(const struct node *node)
 {
-    struct node *best_node = NULL;
+    int best_move = -1;
     fixed_point_t best_score = 0U;
+    fixed_point_t explore = uct_explore_at(node->n_visits);
     for (int i = 0; i < N_GRIDS; i++) {
-        if (!node->children[i])
+        const struct node *child = node->children[i];
+        if (!child)
+            continue;
+        if (child->proven == PROVEN_WIN)
+            return -1;
+        if (child->proven)
             continue;
         fixed_point_t score =
-            uct_score(node->n_visits, node->children[i]->n_visits,
-                      node->children[i]->score);
-        if (score > best_score) {
+            uct_score(explore, child->n_visits, child->score);
+        if (best_move < 0 || score > best_score) {
             best_score = score;
-            best_node = node->children[i];
+            best_move = i;
         }
     }
-    return best_node;
+    return best_move;
 }
 
-static fixed_point_t simulate(const char *table, char player)
+/* Play randomly from board with player to move. The result is scored for the
+ * opponent of player, who made the move leading to board, as backpropagate()
+ * expects.
+ */
+static fixed_point_t playout(struct mcts_info *m,
+                             const board_t *board,
+                             char player)
 {
     char current_player = player;
-    char temp_table[N_GRIDS];
-    memcpy(temp_table, table, N_GRIDS);
-    xoro_jump(&(mcts_obj.xoro_obj));
-    while (1) {
-        int *moves = available_moves(temp_table);
-        if (moves[0] == -1) {
-            kfree(moves);
-            break;
-        }
-        int n_moves = 0;
-        while (n_moves < N_GRIDS && moves[n_moves] != -1)
-            ++n_moves;
-        int move = moves[xoro_next(&(mcts_obj.xoro_obj)) % n_moves];
-        kfree(moves);
-        temp_table[move] = current_player;
-        char win;
-        if ((win = check_win(temp_table)) != ' ')
-            return calculate_win_value(win, player);
+    board_t b = *board;
+    bitboard_t empty = board_empty(&b);
+    int n_empty = bb_popcount(empty);
+    while (n_empty) {
+        int move = bitboard_nth(empty, xoro_bounded(&(m->xoro_obj), n_empty));
+        bitboard_t *own = &b.bits[PLAYER_INDEX(current_player)];
+        *own |= BB_CELL(move);
+        empty &= ~BB_CELL(move);
+        n_empty--;
+        if (bitboard_wins_at(*own, move))
+            return calculate_win_value(current_player, player ^ 'O' ^ 'X');
         current_player ^= 'O' ^ 'X';
     }
     return (fixed_point_t) (1UL << (FIXED_SCALE_BITS - 1));
 }
 
-static void backpropagate(struct node *node, fixed_point_t score)
+/* The mean result of mcts_batch playouts from board, which steadies the
+ * estimate of a leaf without another trip through the tree per playout.
+ */
+static fixed_point_t simulate(struct mcts_info *m,
+                              const board_t *board,
+                              char player)
+{
+    unsigned int batch = clamp(READ_ONCE(mcts_batch), 1U, MAX_BATCH);
+    u32 sum = 0;
+    for (unsigned int i = 0; i < batch; i++)
+        sum += playout(m, board, player);
+    return sum / batch;
+}
+
+/* path[0] is the root and path[depth] the node score is for */
+static void backpropagate(struct node **path, int depth, fixed_point_t score)
+{
+    for (; depth >= 0; depth--) {
+        path[depth]->n_visits++;
+        path[depth]->score += score;
+        score = (1U << FIXED_SCALE_BITS) - score;
+    }
+}
+
+/* The value of node as settled by its children: lost once the opponent has
+ * a winning reply, otherwise known once every reply is.
+ */
+static int proof_of(const struct node *node)
+{
+    bool unproven = false, draw = false;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (!node->children[i])
+            continue;
+        switch (node->children[i]->proven) {
+        case PROVEN_WIN:
+            return PROVEN_LOSS;
+        case PROVEN_DRAW:
+            draw = true;
+            break;
+        case UNPROVEN:
+            unproven = true;
+            break;
+        }
+    }
+    return unproven ? UNPROVEN : draw ? PROVEN_DRAW : PROVEN_WIN;
+}
+
+/* Record the value of the decided node path[depth] and settle the nodes
+ * above it on the path. Other parents of a shared node see the proof when
+ * a search next selects from them.
+ */
+static void prove(struct node **path, int depth, int value)
+{
+    path[depth]->proven = value;
+    while (depth-- > 0) {
+        value = proof_of(path[depth]);
+        if (value == UNPROVEN)
+            return;
+        path[depth]->proven = value;
+    }
+}
+
+static fixed_point_t proof_score(int value)
+{
+    if (value == PROVEN_WIN)
+        return 1U << FIXED_SCALE_BITS;
+    if (value == PROVEN_LOSS)
+        return 0;
+    return 1U << (FIXED_SCALE_BITS - 1);
+}
+
+static bool has_child(const struct node *node, const struct node *child)
 {
-    while (node) {
-        node->n_visits++;
-        node->score += score;
-        node = node->parent;
-        score = 1 - score;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (node->children[i] == child)
+            return true;
     }
+    return false;
 }
 
-static int expand(struct node *node, const char *table)
+/* Returns the number of children added, 0 if the pool cannot hold them all.
+ * With a transposition table, b is in canonical form and so are the children,
+ * and a child whose position already has a node links to it.
+ */
+static int expand(struct mcts_info *m, struct node *node, const board_t *b)
 {
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-    for (int i = 0; i < n_moves; i++) {
-        node->children[i] = new_node(moves[i], node->player ^ 'O' ^ 'X', node);
+    int n_moves = 0, move;
+    bitboard_t empty = board_empty(b);
+    if (m->nr_active_nodes + bb_popcount(empty) > mcts_pool_size)
+        return 0;
+    int own = PLAYER_INDEX(node->player);
+    bitboard_for_each(move, empty) {
+        u64 key = node->key ^ zobrist_table[move][own];
+        struct node *child = NULL;
+        if (m->table) {
+            board_t next = *b;
+            board_play(&next, move, node->player);
+            board_canonical(&next);
+            key = zobrist_board_key(&next);
+            child = table_find(m, key);
+            if (child && has_child(node, child))
+                continue; /* an image of an earlier move */
+        }
+        if (!child)
+            child = new_node(m, key, node->player ^ 'O' ^ 'X');
+        node->children[move] = child;
+        n_moves++;
     }
-    kfree(moves);
+    node->n_children = n_moves;
     return n_moves;
 }
 
-int mcts(const char *table, char player)
+/* The node of the last tree for position b with player to move. Between two
+ * searches of a game, the side that searched has made its move and the
+ * opponent has replied, so b is at most two plies below the old root. With a
+ * transposition table, any node of the last tree for b will do.
+ */
+static struct node *find_reusable(const struct mcts_info *m,
+                                  const board_t *b,
+                                  char player)
+{
+    struct node *node = m->root;
+    if (!node)
+        return NULL;
+    if (m->table) {
+        node = table_find(m, zobrist_board_key(b));
+        return node && node->player == player ? node : NULL;
+    }
+    int own = PLAYER_INDEX(node->player);
+    bitboard_t old_own = m->root_board.bits[own];
+    bitboard_t old_other = m->root_board.bits[!own];
+    if ((old_own & ~b->bits[own]) || (old_other & ~b->bits[!own]))
+        return NULL; /* a different game */
+    bitboard_t added_own = b->bits[own] & ~old_own;
+    bitboard_t added_other = b->bits[!own] & ~old_other;
+    if (bb_popcount(added_own) > 1 || bb_popcount(added_other) > 1 ||
+        (added_other && !added_own))
+        return NULL;
+    if (added_own)
+        node = node->children[__builtin_ctz(added_own)];
+    if (node && added_other)
+        node = node->children[__builtin_ctz(added_other)];
+    return node && node->player == player ? node : NULL;
+}
+
+/* Mark the nodes reachable from node by pointing their next at themselves.
+ * The recursion is as deep as the game is long.
+ */
+static unsigned int mark_reachable(struct node *node)
+{
+    unsigned int n = 1;
+    if (node->next)
+        return 0;
+    node->next = node;
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (node->children[i])
+            n += mark_reachable(node->children[i]);
+    }
+    return n;
+}
+
+/* Move the nodes reachable from root to the front of the pool and drop the
+ * rest. A node can have several parents once transpositions are shared, so
+ * every kept node first gets its new address in next, all child pointers are
+ * redirected through it, and the nodes then slide down in pool order, which
+ * never overwrites one that has yet to move. Returns NULL if the subtree is
+ * too big to keep.
+ */
+static struct node *reuse_tree(struct mcts_info *m, struct node *root)
+{
+    struct node *end = m->pool + m->nr_active_nodes;
+    for (struct node *node = m->pool; node < end; node++)
+        node->next = NULL;
+    unsigned int n_kept = mark_reachable(root);
+    if (n_kept > mcts_reuse_nodes)
+        return NULL;
+
+    struct node *dst = m->pool;
+    for (struct node *node = m->pool; node < end; node++) {
+        if (node->next)
+            node->next = dst++;
+    }
+    for (struct node *node = m->pool; node < end; node++) {
+        for (int i = 0; node->next && i < N_GRIDS; i++) {
+            if (node->children[i])
+                node->children[i] = node->children[i]->next;
+        }
+    }
+    root = root->next;
+    for (struct node *node = m->pool; node < end; node++) {
+        if (node->next && node->next != node)
+            *node->next = *node;
+    }
+    m->nr_active_nodes = n_kept;
+    if (m->table) {
+        memset(m->table, 0, (table_mask + 1) * sizeof(*m->table));
+        for (struct node *node = m->pool; node < m->pool + n_kept; node++)
+            table_insert(m, node);
+    }
+    return root;
+}
+
+/* Whether the most visited child of root, leaving out proven losses, stays
+ * ahead even if all remaining iterations go to its closest rival. Each
+ * iteration adds at most one visit to one root child.
+ */
+static bool decided(const struct node *root, int remaining)
+{
+    int first = -1, second = -1;
+    for (int i = 0; i < N_GRIDS; i++) {
+        const struct node *child = root->children[i];
+        if (!child || child->proven == PROVEN_LOSS)
+            continue;
+        if (child->n_visits > first) {
+            second = first;
+            first = child->n_visits;
+        } else if (child->n_visits > second) {
+            second = child->n_visits;
+        }
+    }
+    return first >= 0 && (second < 0 || first - second > remaining);
+}
+
+/* Run up to iterations playouts from board with player to move, or until
+ * deadline if it is non-zero, starting from the tree kept by the last search
+ * of m when it leads there. With a transposition table, board is in canonical
+ * form. Returns the number of iterations run.
+ */
+static int search(struct mcts_info *m,
+                  const board_t *board,
+                  char player,
+                  int iterations,
+                  ktime_t deadline)
 {
-    char win;
-    struct node *root = new_node(-1, player, NULL);
-    mcts_obj.nr_active_nodes = 1;
-    for (int i = 0; i < ITERATIONS; i++) {
-        struct node *node = root;
-        char temp_table[N_GRIDS];
-        memcpy(temp_table, table, N_GRIDS);
+    board_t root_board = *board;
+    char root_win = board_check_win(&root_board);
+    struct node *root = find_reusable(m, &root_board, player);
+    if (root)
+        root = reuse_tree(m, root);
+    if (!root) {
+        m->nr_active_nodes = 0;
+        if (m->table)
+            memset(m->table, 0, (table_mask + 1) * sizeof(*m->table));
+        root = new_node(m, zobrist_board_key(&root_board), player);
+    }
+    m->root = root;
+    m->root_board = root_board;
+    int i;
+    for (i = 0; i < iterations && !root->proven; i++) {
+        if (READ_ONCE(m->ctx->solved))
+            break;
+        if (deadline && i && !(i % DEADLINE_CHECK_INTERVAL)) {
+            if (ktime_after(ktime_get(), deadline))
+                break;
+            cond_resched();
+        }
+        if (!deadline && i && !(i % EARLY_STOP_INTERVAL) &&
+            decided(root, iterations - i))
+            break;
+        struct node *path[N_GRIDS + 1] = {root}, *node = root;
+        int depth = 0;
+        board_t b = root_board;
+        char win = root_win;
         while (1) {
-            if ((win = check_win(temp_table)) != ' ') {
+            if (win != ' ') {
                 fixed_point_t score =
                     calculate_win_value(win, node->player ^ 'O' ^ 'X');
-                backpropagate(node, score);
+                prove(path, depth, win == 'D' ? PROVEN_DRAW : PROVEN_WIN);
+                backpropagate(path, depth, score);
                 break;
             }
             if (node->n_visits == 0) {
-                fixed_point_t score = simulate(temp_table, node->player);
-                backpropagate(node, score);
+                fixed_point_t score = simulate(m, &b, node->player);
+                backpropagate(path, depth, score);
+                break;
+            }
+            if (!node->n_children && !expand(m, node, &b)) {
+                /* Out of nodes: keep refining this leaf with rollouts */
+                backpropagate(path, depth, simulate(m, &b, node->player));
+                break;
+            }
+            int move = select_move(node);
+            if (move < 0) {
+                int value = proof_of(node);
+                prove(path, depth, value);
+                backpropagate(path, depth, proof_score(value));
                 break;
             }
-            if (node->children[0] == NULL)
-                mcts_obj.nr_active_nodes += expand(node, temp_table);
-            node = select_move(node);
-            if (!node)
-                return -1;
-            temp_table[node->move] = node->player ^ 'O' ^ 'X';
+            char mover = node->player;
+            node = path[++depth] = node->children[move];
+            board_play(&b, move, mover);
+            win = board_check_win_after(&b, move, mover);
+            if (m->table)
+                board_canonical(&b);
+        }
+    }
+    if (root->proven)
+        WRITE_ONCE(m->ctx->solved, true);
+    return i;
+}
+
+static void mcts_work(struct work_struct *work)
+{
+    struct mcts_info *m = container_of(work, struct mcts_info, work);
+    m->iterations =
+        search(m, &m->board, m->player, m->iterations, m->deadline);
+}
+
+int mcts(struct mcts_ctx *ctx,
+         const char *table,
+         char player,
+         unsigned int budget_us,
+         int *iterations)
+{
+    board_t board;
+    board_from_table(&board, table);
+    int move = tablebase_move(&board, player);
+    if (move >= 0) {
+        if (iterations)
+            *iterations = 0;
+        return move;
+    }
+    /* Sharing transpositions, the workers search the canonical form */
+    int sym = mcts_transpositions ? board_canonical(&board) : 0;
+    int share = ITERATIONS / mcts_workers;
+    ktime_t deadline = 0;
+    WRITE_ONCE(ctx->solved, false);
+    if (!budget_us)
+        budget_us = READ_ONCE(mcts_budget_us);
+    if (budget_us) {
+        deadline = ktime_add_us(ktime_get(), min(budget_us, MAX_BUDGET_US));
+        share = INT_MAX;
+    }
+    for (int i = 1; i < mcts_workers; i++) {
+        struct mcts_info *m = &ctx->workers[i];
+        m->board = board;
+        m->player = player;
+        m->iterations = share;
+        m->deadline = deadline;
+        queue_work(system_unbound_wq, &m->work);
+    }
+    int total =
+        search(&ctx->workers[0], &board, player,
+               deadline ? share : ITERATIONS - (mcts_workers - 1) * share,
+               deadline);
+
+    /* A proven win beats any visit count, a proven loss is the last resort */
+    int visits[N_GRIDS] = {0}, rank[N_GRIDS];
+    for (int i = 0; i < N_GRIDS; i++)
+        rank[i] = -1;
+    int active_nodes = 0;
+    for (int i = 0; i < mcts_workers; i++) {
+        struct mcts_info *m = &ctx->workers[i];
+        if (i) {
+            flush_work(&m->work);
+            total += m->iterations;
+        }
+        active_nodes += m->nr_active_nodes;
+        for (int j = 0; j < N_GRIDS; j++) {
+            const struct node *child = m->root->children[j];
+            if (!child)
+                continue;
+            visits[j] += child->n_visits;
+            if (child->proven == PROVEN_WIN)
+                rank[j] = 2;
+            else if (child->proven == PROVEN_LOSS)
+                rank[j] = 0;
+            else if (rank[j] < 0)
+                rank[j] = 1;
         }
     }
-    struct node *best_node = root;
-    int most_visits = -1;
+    int best_move = -1;
     for (int i = 0; i < N_GRIDS; i++) {
-        if (root->children[i] && root->children[i]->n_visits > most_visits) {
-            most_visits = root->children[i]->n_visits;
-            best_node = root->children[i];
+        if (rank[i] < 0)
+            continue;
+        if (best_move < 0 || rank[i] > rank[best_move] ||
+            (rank[i] == rank[best_move] && visits[i] > visits[best_move]))
+            best_move = i;
+    }
+    spin_lock(&mcts_stats_lock);
+    mcts_active_nodes = active_nodes;
+    if (!deadline)
+        mcts_saved_iterations += ITERATIONS - total;
+    spin_unlock(&mcts_stats_lock);
+    if (iterations)
+        *iterations = total;
+    return bitboard_transform_move(best_move, sym_inverse[sym]);
+}
+
+struct mcts_ctx *mcts_ctx_alloc(void)
+{
+    struct mcts_ctx *ctx =
+        kzalloc(struct_size(ctx, workers, mcts_workers), GFP_KERNEL);
+    if (!ctx)
+        return NULL;
+    for (int i = 0; i < mcts_workers; i++) {
+        struct mcts_info *m = &ctx->workers[i];
+        m->ctx = ctx;
+        INIT_WORK(&m->work, mcts_work);
+        m->pool =
+            kvmalloc_array(mcts_pool_size, sizeof(struct node), GFP_KERNEL);
+        if (!m->pool)
+            goto fail;
+        if (mcts_transpositions) {
+            m->table = kvcalloc(table_mask + 1, sizeof(*m->table), GFP_KERNEL);
+            if (!m->table)
+                goto fail;
         }
+        /* 2^96 draws apart */
+        spin_lock(&mcts_streams_lock);
+        m->xoro_obj = mcts_streams;
+        xoro_long_jump(&mcts_streams);
+        spin_unlock(&mcts_streams_lock);
     }
-    int best_move = best_node->move;
-    free_node(root);
-    return best_move;
+    return ctx;
+
+fail:
+    pr_info("kxo: Failed to allocate space for MCTS\n");
+    mcts_ctx_free(ctx);
+    return NULL;
+}
+
+void mcts_ctx_free(struct mcts_ctx *ctx)
+{
+    for (int i = 0; ctx && i < mcts_workers; i++) {
+        kvfree(ctx->workers[i].pool);
+        kvfree(ctx->workers[i].table);
+    }
+    kfree(ctx);
+}
+
+int mcts_init(void)
+{
+    bitboard_init();
+    if (mcts_pool_size < N_GRIDS + 1)
+        mcts_pool_size = N_GRIDS + 1;
+    mcts_workers = clamp(mcts_workers, 1U, nr_cpu_ids);
+    uct_explore =
+        kvmalloc_array(UCT_TABLE_SIZE, sizeof(*uct_explore), GFP_KERNEL);
+    uct_inv = kvmalloc_array(UCT_TABLE_SIZE, sizeof(*uct_inv), GFP_KERNEL);
+    if (!uct_explore || !uct_inv) {
+        pr_info("kxo: Failed to allocate space for MCTS\n");
+        mcts_exit();
+        return -ENOMEM;
+    }
+    if (!mcts_seed)
+        mcts_seed = get_random_u64();
+    xoro_seed(&mcts_streams, mcts_seed);
+    if (mcts_transpositions) {
+        int ret = zobrist_init();
+        if (ret) {
+            mcts_exit();
+            return ret;
+        }
+        table_mask = roundup_pow_of_two(mcts_pool_size) - 1;
+    }
+    uct_tables_init();
+    return 0;
 }
 
-void mcts_init(void)
+void mcts_exit(void)
 {
-    xoro_init(&(mcts_obj.xoro_obj));
-    mcts_obj.nr_active_nodes = 0;
+    kvfree(uct_explore);
+    kvfree(uct_inv);
 }
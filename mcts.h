@@ -1,13 +1,47 @@
 #pragma once
 
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+
+#include "bitboard.h"
 #include "xoroshiro.h"
 
 #define ITERATIONS 100000
 
+struct node;
+struct mcts_ctx;
+
 struct mcts_info {
+    struct mcts_ctx *ctx; /* that the worker belongs to */
     struct state_array xoro_obj;
-    int nr_active_nodes;
+    int nr_active_nodes; /* nodes taken from pool by the current search */
+    struct node *pool;   /* preallocated tree nodes */
+    struct node **table; /* transposition buckets, NULL if not shared */
+    struct node *root;   /* tree of the last search, NULL if there is none */
+    board_t root_board;  /* position at root */
+    /* search request for a worker other than the first */
+    struct work_struct work;
+    board_t board;
+    char player;
+    int iterations; /* to run, then run */
+    ktime_t deadline;
 };
 
-int mcts(const char *table, char player);
-void mcts_init(void);
+/* Search state of one client. Clients search in parallel, each one from its
+ * own trees and random streams, and a context is only used by one search at a
+ * time.
+ */
+struct mcts_ctx *mcts_ctx_alloc(void);
+void mcts_ctx_free(struct mcts_ctx *ctx);
+
+/* Pick a move for player. budget_us bounds the search time, 0 falls back to
+ * the mcts_budget_us parameter and then to ITERATIONS. The number of
+ * iterations run is stored in *iterations unless it is NULL.
+ */
+int mcts(struct mcts_ctx *ctx,
+         const char *table,
+         char player,
+         unsigned int budget_us,
+         int *iterations);
+int mcts_init(void);
+void mcts_exit(void);
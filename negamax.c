@@ -1,99 +1,353 @@
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/overflow.h>
 #include <linux/slab.h>
-#include <linux/sort.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
 
+#include "bitboard.h"
 #include "game.h"
 #include "negamax.h"
+#include "tablebase.h"
 #include "util.h"
 #include "zobrist.h"
 
 #define MAX_SEARCH_DEPTH 6
 
-static int history_score_sum[N_GRIDS];
-static int history_count[N_GRIDS];
+/* Late-move reductions: past the first LMR_FULL_MOVES moves of a node with
+ * at least LMR_MIN_DEPTH plies left, a move is searched one ply shallower,
+ * and again at full depth only if it then beats alpha.
+ */
+#define LMR_FULL_MOVES 3
+#define LMR_MIN_DEPTH 3
 
-static u64 hash_value;
+/* Futility pruning: a move never raises the get_score() of the opponent, so
+ * with up to two plies left the score right after our move bounds its value
+ * and a move not beating alpha that way is not searched. Up to
+ * FUTILITY_DEPTH plies, each further move of ours is assumed to gain at most
+ * futility_margin, which is a guess and no longer a bound.
+ */
+#define FUTILITY_DEPTH 4
 
-static int cmp_moves(const void *a, const void *b)
+/* The last two moves that caused a beta cutoff, per number of stones on the
+ * board, which is the ply counted from the start of the game.
+ */
+#define N_KILLERS 2
+
+/* Search state of one worker. Moves are tried in order of the average score
+ * they got so far, kept up to date in history_score[] so that picking one
+ * needs no division.
+ */
+struct negamax_info {
+    eval_t e;
+    int history_score_sum[N_GRIDS];
+    int history_count[N_GRIDS];
+    int history_score[N_GRIDS];
+    s8 killers[N_GRIDS][N_KILLERS];
+    bool stop; /* abandon the search, set for helpers only */
+    bool lmr, futility; /* parameters of the current search */
+    /* search request for a worker other than the first */
+    struct work_struct work;
+    board_t board;
+    char player;
+    int depth; /* to start from */
+};
+
+/* Lazy SMP: the other workers search the same root as workers[0], half of
+ * them one ply deeper, and only share what they find through the
+ * transposition table. They are stopped as soon as the first one is done,
+ * whose move is the one played. Every client has workers of its own, while
+ * all of them share the transposition table.
+ */
+struct negamax_ctx {
+    unsigned int n_workers;
+    struct negamax_info workers[];
+};
+
+static unsigned int negamax_workers = 1;
+module_param(negamax_workers, uint, 0444);
+MODULE_PARM_DESC(negamax_workers, "Number of CPUs running negamax in parallel");
+
+static unsigned int negamax_depth = MAX_SEARCH_DEPTH;
+module_param(negamax_depth, uint, 0644);
+MODULE_PARM_DESC(negamax_depth, "Plies searched by negamax");
+
+static bool negamax_lmr;
+module_param(negamax_lmr, bool, 0644);
+MODULE_PARM_DESC(negamax_lmr, "Search late negamax moves one ply shallower");
+
+static bool negamax_futility;
+module_param(negamax_futility, bool, 0644);
+MODULE_PARM_DESC(negamax_futility,
+                 "Skip negamax moves near the horizon that cannot beat alpha");
+
+static int futility_margin;
+
+enum { PICK_TT, PICK_KILLERS, PICK_HISTORY = PICK_KILLERS + N_KILLERS };
+
+/* Hands out the moves of a node in stages: the move of its transposition
+ * table entry, the killers of its ply, then the others by history score.
+ * Each one is picked when it is needed, so a cutoff saves ordering the rest.
+ */
+typedef struct {
+    bitboard_t left; /* moves not handed out yet */
+    int stage;
+    int tt_move;
+    const s8 *killers;
+    const int *history_score;
+} move_picker_t;
+
+static void picker_init(move_picker_t *p,
+                        const struct negamax_info *w,
+                        int tt_move,
+                        const s8 *ply_killers)
+{
+    p->left = board_empty(&w->e.board);
+    p->stage = PICK_TT;
+    p->tt_move = tt_move;
+    p->killers = ply_killers;
+    p->history_score = w->history_score;
+}
+
+/* The next move to search, or -1 when there is none left */
+static int picker_next(move_picker_t *p)
 {
-    const int *_a = (int *) a, *_b = (int *) b;
-    int score_a = 0, score_b = 0;
-
-    if (history_count[*_a])
-        score_a = history_score_sum[*_a] / history_count[*_a];
-    if (history_count[*_b])
-        score_b = history_score_sum[*_b] / history_count[*_b];
-    return score_b - score_a;
+    int move, best = -1;
+
+    while (p->stage < PICK_HISTORY) {
+        move = p->stage == PICK_TT ? p->tt_move
+                                   : p->killers[p->stage - PICK_KILLERS];
+        p->stage++;
+        if (move >= 0 && (p->left & BB_CELL(move))) {
+            p->left &= ~BB_CELL(move);
+            return move;
+        }
+    }
+    bitboard_for_each(move, p->left) {
+        if (best < 0 || p->history_score[move] > p->history_score[best])
+            best = move;
+    }
+    if (best >= 0)
+        p->left &= ~BB_CELL(best);
+    return best;
+}
+
+static void history_update(struct negamax_info *w, int move, int score)
+{
+    w->history_count[move]++;
+    w->history_score_sum[move] += score;
+    w->history_score[move] =
+        w->history_score_sum[move] / w->history_count[move];
 }
 
-static move_t negamax(char *table, int depth, char player, int alpha, int beta)
+static void killer_update(s8 *ply_killers, int move)
 {
-    if (check_win(table) != ' ' || depth == 0) {
-        move_t result = {get_score(table, player), -1};
+    if (ply_killers[0] == move)
+        return;
+    for (int i = N_KILLERS - 1; i > 0; i--)
+        ply_killers[i] = ply_killers[i - 1];
+    ply_killers[0] = move;
+}
+
+static move_t negamax(struct negamax_info *w,
+                      int depth,
+                      char player,
+                      int alpha,
+                      int beta)
+{
+    eval_t *e = &w->e;
+
+    if (depth == 0) {
+        move_t result = {eval_score(e, player), -1};
         return result;
     }
-    const zobrist_entry_t *entry = zobrist_get(hash_value);
-    if (entry)
-        return (move_t){.score = entry->score, .move = entry->move};
 
-    int score;
+    /* Scores are relative to the side to move, so it is part of the key. All
+     * images of the position share the entry of its canonical form, which
+     * holds the move as played there.
+     */
+    board_t canonical = e->board;
+    int sym = board_canonical(&canonical);
+    u64 key = zobrist_board_key(&canonical);
+    if (player == 'O')
+        key ^= zobrist_player;
+    zobrist_entry_t entry;
+    int tt_move = -1;
+    if (zobrist_get(key, &entry)) {
+        move_t stored = {
+            .score = entry.score,
+            .move = bitboard_transform_move(entry.move, sym_inverse[sym]),
+        };
+        if (entry.depth >= depth) {
+            if (entry.bound == ZOBRIST_EXACT)
+                return stored;
+            if (entry.bound == ZOBRIST_LOWER && stored.score > alpha)
+                alpha = stored.score;
+            else if (entry.bound == ZOBRIST_UPPER && stored.score < beta)
+                beta = stored.score;
+            if (alpha >= beta)
+                return stored;
+        }
+        tt_move = stored.move;
+    }
+
+    int score, alpha_orig = alpha;
     move_t best_move = {-10000, -1};
-    int *moves = available_moves(table);
-    int n_moves = 0;
-    while (n_moves < N_GRIDS && moves[n_moves] != -1)
-        ++n_moves;
-
-    sort(moves, n_moves, sizeof(int), cmp_moves, NULL);
-
-    for (int i = 0; i < n_moves; i++) {
-        table[moves[i]] = player;
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
-        if (!i)
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X', -beta,
+    s8 *ply_killers =
+        w->killers[bb_popcount(e->board.bits[0] | e->board.bits[1])];
+    move_picker_t picker;
+    int move;
+
+    /* What our later moves may add to a score, -1 not to prune */
+    int margin = w->futility && depth <= FUTILITY_DEPTH
+                     ? (depth - 1) / 2 * futility_margin
+                     : -1;
+
+    picker_init(&picker, w, tt_move, ply_killers);
+    for (int i = 0; (move = picker_next(&picker)) >= 0; i++) {
+        eval_play(e, move, player);
+        if (board_check_win_after(&e->board, move, player) != ' ')
+            score = eval_score(e, player);
+        else if (margin >= 0 && eval_score(e, player) + margin <= alpha)
+            score = eval_score(e, player) + margin;
+        else if (!i)
+            score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X', -beta,
                              -alpha)
                          .score;
         else {
-            score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
+            int reduced =
+                w->lmr && i >= LMR_FULL_MOVES && depth >= LMR_MIN_DEPTH;
+            score = -negamax(w, depth - 1 - reduced, player == 'X' ? 'O' : 'X',
                              -alpha - 1, -alpha)
                          .score;
+            if (reduced && score > alpha)
+                score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X',
+                                 -alpha - 1, -alpha)
+                             .score;
             if (alpha < score && score < beta)
-                score = -negamax(table, depth - 1, player == 'X' ? 'O' : 'X',
+                score = -negamax(w, depth - 1, player == 'X' ? 'O' : 'X',
                                  -beta, -score)
                              .score;
         }
-        history_count[moves[i]]++;
-        history_score_sum[moves[i]] += score;
+        eval_undo(e, move, player);
+        /* The scores of an abandoned search are meaningless */
+        if (READ_ONCE(w->stop))
+            return best_move;
+        history_update(w, move, score);
         if (score > best_move.score) {
             best_move.score = score;
-            best_move.move = moves[i];
+            best_move.move = move;
         }
-        table[moves[i]] = ' ';
-        hash_value ^= zobrist_table[moves[i]][player == 'X'];
         if (score > alpha)
             alpha = score;
-        if (alpha >= beta)
+        if (alpha >= beta) {
+            killer_update(ply_killers, move);
             break;
+        }
     }
 
-    kfree((char *) moves);
-    zobrist_put(hash_value, best_move.score, best_move.move);
+    zobrist_put(key, best_move.score,
+                bitboard_transform_move(best_move.move, sym), depth,
+                best_move.score <= alpha_orig ? ZOBRIST_UPPER
+                : best_move.score >= beta     ? ZOBRIST_LOWER
+                                              : ZOBRIST_EXACT);
     return best_move;
 }
 
-void negamax_init(void)
+static void worker_reset(struct negamax_info *w, const board_t *b)
 {
-    zobrist_init();
-    hash_value = 0;
+    w->lmr = READ_ONCE(negamax_lmr);
+    w->futility = READ_ONCE(negamax_futility);
+    memset(w->history_score_sum, 0, sizeof(w->history_score_sum));
+    memset(w->history_count, 0, sizeof(w->history_count));
+    memset(w->history_score, 0, sizeof(w->history_score));
+    memset(w->killers, -1, sizeof(w->killers));
+    eval_init(&w->e, b);
+}
+
+/* Helpers deepen by two plies like the first worker, the odd ones starting
+ * one ply deeper, until they are stopped.
+ */
+static void negamax_work(struct work_struct *work)
+{
+    struct negamax_info *w = container_of(work, struct negamax_info, work);
+    int max_depth = bb_popcount(board_empty(&w->board));
+
+    worker_reset(w, &w->board);
+    for (int depth = w->depth; depth <= max_depth && !READ_ONCE(w->stop);
+         depth += 2)
+        negamax(w, depth, w->player, -100000, 100000);
+}
+
+int negamax_init(void)
+{
+    int ret;
+
+    bitboard_init();
+    ret = zobrist_init();
+    if (ret)
+        return ret;
+    futility_margin = line_scores[GOAL - 1];
+    negamax_workers = clamp(negamax_workers, 1U, nr_cpu_ids);
+    return 0;
 }
 
-move_t negamax_predict(char *table, char player)
+void negamax_exit(void)
 {
-    memset(history_score_sum, 0, sizeof(history_score_sum));
-    memset(history_count, 0, sizeof(history_count));
+    zobrist_exit();
+}
+
+struct negamax_ctx *negamax_ctx_alloc(void)
+{
+    struct negamax_ctx *ctx =
+        kzalloc(struct_size(ctx, workers, negamax_workers), GFP_KERNEL);
+    if (!ctx) {
+        pr_info("kxo: Failed to allocate space for negamax\n");
+        return NULL;
+    }
+    ctx->n_workers = negamax_workers;
+    for (int i = 1; i < ctx->n_workers; i++)
+        INIT_WORK(&ctx->workers[i].work, negamax_work);
+    return ctx;
+}
+
+void negamax_ctx_free(struct negamax_ctx *ctx)
+{
+    kfree(ctx);
+}
+
+move_t negamax_predict(struct negamax_ctx *ctx, char *table, char player)
+{
+    struct negamax_info *w = &ctx->workers[0];
     move_t result;
-    for (int depth = 2; depth <= MAX_SEARCH_DEPTH; depth += 2) {
-        result = negamax(table, depth, player, -100000, 100000);
-        zobrist_clear();
+    board_t b;
+    board_from_table(&b, table);
+    if (board_check_win(&b) != ' ')
+        return (move_t){.score = get_board_score(&b, player), .move = -1};
+    int move = tablebase_move(&b, player);
+    if (move >= 0) {
+        board_play(&b, move, player);
+        return (move_t){.score = get_board_score(&b, player), .move = move};
+    }
+    zobrist_age();
+    for (int i = 1; i < ctx->n_workers; i++) {
+        struct negamax_info *h = &ctx->workers[i];
+        h->board = b;
+        h->player = player;
+        h->depth = 2 + i % 2;
+        WRITE_ONCE(h->stop, false);
+        queue_work(system_unbound_wq, &h->work);
+    }
+    worker_reset(w, &b);
+    /* Deepen two plies at a time, ending on the configured depth */
+    int max_depth =
+        clamp_t(unsigned int, READ_ONCE(negamax_depth), 1, N_GRIDS);
+    for (int depth = 2 - max_depth % 2; depth <= max_depth; depth += 2)
+        result = negamax(w, depth, player, -100000, 100000);
+    for (int i = 1; i < ctx->n_workers; i++) {
+        WRITE_ONCE(ctx->workers[i].stop, true);
+        flush_work(&ctx->workers[i].work);
     }
     return result;
 }
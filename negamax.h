@@ -4,5 +4,12 @@ typedef struct {
     int score, move;
 } move_t;
 
-void negamax_init(void);
-move_t negamax_predict(char *table, char player);
+struct negamax_ctx;
+
+int negamax_init(void);
+void negamax_exit(void);
+
+/* Search state of one client, used by one search at a time */
+struct negamax_ctx *negamax_ctx_alloc(void);
+void negamax_ctx_free(struct negamax_ctx *ctx);
+move_t negamax_predict(struct negamax_ctx *ctx, char *table, char player);
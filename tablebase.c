@@ -0,0 +1,66 @@
+#include <linux/errno.h>
+#include <linux/firmware.h>
+#include <linux/kernel.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "tablebase.h"
+
+/* Loaded from /lib/firmware when the module is inserted. Without it, or if
+ * it was built for other rules, the engines search every move as before.
+ */
+static char *tablebase = "kxo-tablebase.bin";
+module_param(tablebase, charp, 0444);
+MODULE_PARM_DESC(tablebase, "Firmware file of the tablebase, empty for none");
+
+static bool tablebase_enabled = true;
+module_param(tablebase_enabled, bool, 0644);
+MODULE_PARM_DESC(tablebase_enabled, "Answer covered positions from it");
+
+static u8 *tablebase_values;
+
+int tablebase_init(struct device *dev)
+{
+    const struct firmware *fw;
+    const struct tablebase_header *header;
+    size_t size = (tablebase_size() + 3) / 4;
+
+    if (!tablebase || !*tablebase)
+        return 0;
+    if (request_firmware(&fw, tablebase, dev)) {
+        pr_info("kxo: no tablebase %s, searching every move\n", tablebase);
+        return 0;
+    }
+    header = (const struct tablebase_header *) fw->data;
+    if (fw->size != sizeof(*header) + size ||
+        memcmp(header->magic, TABLEBASE_MAGIC, sizeof(header->magic)) ||
+        header->board_size != BOARD_SIZE || header->goal != GOAL ||
+        header->allow_exceed != tablebase_allow_exceed()) {
+        pr_info("kxo: %s does not match the rules of kxo\n", tablebase);
+        release_firmware(fw);
+        return 0;
+    }
+    tablebase_values = vmalloc(size);
+    if (!tablebase_values) {
+        release_firmware(fw);
+        return -ENOMEM;
+    }
+    memcpy(tablebase_values, header + 1, size);
+    release_firmware(fw);
+    pr_info("kxo: loaded tablebase %s\n", tablebase);
+    return 0;
+}
+
+void tablebase_exit(void)
+{
+    vfree(tablebase_values);
+    tablebase_values = NULL;
+}
+
+int tablebase_move(const board_t *b, char player)
+{
+    if (!tablebase_values || !READ_ONCE(tablebase_enabled))
+        return -1;
+    return tablebase_pick(tablebase_values, b, player);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+/* Perfect-play tablebase shared by the kernel module and the userspace
+ * engines. xo-tablebase solves every position of the board offline and
+ * stores, 2 bits per position, whether the side to move wins, draws or loses.
+ * Positions are indexed by their base-3 number, cell i being digit i: 0 for
+ * an empty cell, 1 for 'O' and 2 for 'X'.
+ *
+ * 'O' always moves first, so the side to move is the one with fewer stones,
+ * 'O' on equal counts. Positions where it is not are not covered.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#endif
+
+#include "bitboard.h"
+
+#define TABLEBASE_MAGIC "KXOTB01"
+
+/* Values, for the side to move */
+enum { TB_UNKNOWN, TB_LOSS, TB_DRAW, TB_WIN };
+
+/* The values follow this header in the file, 4 positions per byte */
+struct tablebase_header {
+    char magic[8];
+    uint8_t board_size, goal;
+    uint8_t allow_exceed; /* whether lines longer than goal win */
+    uint8_t reserved;
+    uint32_t n_positions;
+} __attribute__((packed));
+
+static inline uint32_t tablebase_size(void)
+{
+    uint32_t n = 1;
+    for (int i = 0; i < N_GRIDS; i++)
+        n *= 3;
+    return n;
+}
+
+/* Whether overlong lines win under the rules of line_masks[] */
+static inline bool tablebase_allow_exceed(void)
+{
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        if (line_masks[i].ends)
+            return false;
+    }
+    return true;
+}
+
+static inline uint32_t tablebase_index(const board_t *b)
+{
+    uint32_t index = 0;
+    for (int i = N_GRIDS - 1; i >= 0; i--) {
+        index *= 3;
+        if (b->bits[0] & BB_CELL(i))
+            index += 1;
+        else if (b->bits[1] & BB_CELL(i))
+            index += 2;
+    }
+    return index;
+}
+
+static inline int tablebase_value(const uint8_t *values, uint32_t index)
+{
+    return (values[index >> 2] >> ((index & 3) * 2)) & 3;
+}
+
+/* The move of player from b under perfect play, or -1 if the position is not
+ * covered, already decided or lost. A winning move is taken at once, otherwise
+ * the first move that keeps the best value. Every move of a lost position is
+ * as good as another here, so those are left to the search, which at least
+ * makes the opponent find the win.
+ */
+static inline int tablebase_pick(const uint8_t *values,
+                                 const board_t *b,
+                                 char player)
+{
+    int n_own = bb_popcount(b->bits[PLAYER_INDEX(player)]);
+    int n_opp = bb_popcount(b->bits[!PLAYER_INDEX(player)]);
+    if (n_own != n_opp - (player == 'X') || board_check_win(b) != ' ')
+        return -1;
+
+    uint32_t index = tablebase_index(b), pow3 = 1;
+    uint32_t digit = PLAYER_INDEX(player) + 1;
+    int best = -1, best_value = TB_UNKNOWN, move;
+    bitboard_t empty = board_empty(b);
+    for (move = 0; move < N_GRIDS; move++, pow3 *= 3) {
+        if (!(empty & BB_CELL(move)))
+            continue;
+        if (bitboard_wins_at(b->bits[PLAYER_INDEX(player)] | BB_CELL(move),
+                             move))
+            return move;
+        /* The value of the move is the opposite of what the opponent gets */
+        int value = tablebase_value(values, index + digit * pow3);
+        if (value == TB_UNKNOWN)
+            return -1;
+        value = TB_WIN + TB_LOSS - value;
+        if (value > best_value) {
+            best = move;
+            best_value = value;
+        }
+    }
+    return best_value == TB_LOSS ? -1 : best;
+}
+
+/* Implemented by the kernel module and by the userspace engines. The move
+ * of player from b, or -1 if no tablebase covering it is loaded.
+ */
+int tablebase_move(const board_t *b, char player);
+
+#ifdef __KERNEL__
+struct device;
+
+/* Load the tablebase named by the tablebase parameter, if there is one */
+int tablebase_init(struct device *dev);
+void tablebase_exit(void);
+#else
+/* Map a file written by xo-tablebase, after bitboard_init(). Return 0, or
+ * -1 if it is missing or was built for other rules.
+ */
+int tablebase_load(const char *path);
+void tablebase_unload(void);
+#endif
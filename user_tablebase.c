@@ -0,0 +1,53 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tablebase.h"
+
+/* The file stays mapped read-only, so processes share its pages */
+static const uint8_t *mapping;
+static size_t mapping_size;
+
+int tablebase_load(const char *path)
+{
+    size_t size = sizeof(struct tablebase_header) + (tablebase_size() + 3) / 4;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size == (off_t) size)
+        p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    const struct tablebase_header *header = p;
+    if (memcmp(header->magic, TABLEBASE_MAGIC, sizeof(header->magic)) ||
+        header->board_size != BOARD_SIZE || header->goal != GOAL ||
+        header->allow_exceed != tablebase_allow_exceed()) {
+        munmap(p, size);
+        return -1;
+    }
+    tablebase_unload();
+    mapping = p;
+    mapping_size = size;
+    return 0;
+}
+
+void tablebase_unload(void)
+{
+    if (mapping)
+        munmap((void *) mapping, mapping_size);
+    mapping = NULL;
+}
+
+int tablebase_move(const board_t *b, char player)
+{
+    if (!mapping)
+        return -1;
+    return tablebase_pick(mapping + sizeof(struct tablebase_header), b,
+                          player);
+}
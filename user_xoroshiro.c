@@ -25,10 +25,8 @@ uint64_t xoro_next(state_array *obj)
     return result;
 }
 
-void xoro_jump(state_array *obj)
+static void jump(state_array *obj, const uint64_t *JUMP)
 {
-    static const uint64_t JUMP[] = {0xdf900294d8f554a5ULL,
-                                    0x170865df4b3201fcULL};
     uint64_t s0 = 0, s1 = 0;
     for (int i = 0; i < 2; i++) {
         for (int b = 0; b < 64; b++) {
@@ -43,6 +41,31 @@ void xoro_jump(state_array *obj)
     obj->array[1] = s1;
 }
 
+/* Equivalent to 2^64 calls to xoro_next() */
+void xoro_jump(state_array *obj)
+{
+    static const uint64_t JUMP[] = {0xdf900294d8f554a5ULL,
+                                    0x170865df4b3201fcULL};
+    jump(obj, JUMP);
+}
+
+/* Equivalent to 2^96 calls to xoro_next(), to start independent streams */
+void xoro_long_jump(state_array *obj)
+{
+    static const uint64_t LONG_JUMP[] = {0xd2a98b26625eee7bULL,
+                                         0xdddf9b1090aa7ac1ULL};
+    jump(obj, LONG_JUMP);
+}
+
+/* SplitMix64, which spreads a small seed over the whole state */
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
 void xoro_init(state_array *obj)
 {
     struct timespec ts;
@@ -50,4 +73,11 @@ void xoro_init(state_array *obj)
     uint64_t s0 = (uint64_t) ts.tv_nsec ^ (uint64_t) ts.tv_sec;
     uint64_t s1 = (s0 << 32) | (ts.tv_nsec & 0xffffffff);
     seed(obj, s0, s1);
-}
\ No newline at end of file
+}
+
+/* The same seed always gives the same stream */
+void xoro_seed(state_array *obj, uint64_t s)
+{
+    uint64_t s0 = splitmix64(&s);
+    seed(obj, s0, splitmix64(&s));
+}
@@ -9,6 +9,16 @@ typedef struct state_array {
 
 uint64_t xoro_next(state_array *obj);
 void xoro_jump(state_array *obj);
+void xoro_long_jump(state_array *obj);
 void xoro_init(state_array *obj);
+void xoro_seed(state_array *obj, uint64_t seed);
+
+/* Uniform draw in [0, n) from the high bits by a multiply and a shift instead
+ * of a division, biased by at most n / 2^32.
+ */
+static inline uint32_t xoro_bounded(state_array *obj, uint32_t n)
+{
+    return ((xoro_next(obj) >> 32) * n) >> 32;
+}
 
 #endif
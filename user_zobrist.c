@@ -2,13 +2,36 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include "user_hlist.h"
 
-#define HASH(key) ((key) % HASH_TABLE_SIZE)
+#define ZOBRIST_TABLE_MASK ((1U << ZOBRIST_TABLE_BITS) - 1)
 
 uint64_t zobrist_table[UTIL_N_GRIDS][2];
-static struct hlist_head hash_table[HASH_TABLE_SIZE];
+uint64_t zobrist_player;
+
+/* Threads share the table without locking. A slot holds its entry packed
+ * into one word and the key XORed with that word, so an entry torn between
+ * two writers matches no key and reads as a miss.
+ */
+typedef struct {
+    uint64_t lock;
+    uint64_t data;
+} zobrist_slot_t;
+
+union zobrist_word {
+    zobrist_entry_t entry;
+    uint64_t data;
+};
+
+_Static_assert(sizeof(zobrist_entry_t) == sizeof(uint64_t),
+               "a zobrist entry must fit in one word");
+
+/* Entries stay valid across searches, the generation that stored them only
+ * tells which ones can be replaced first.
+ */
+static zobrist_slot_t hash_table[1U << ZOBRIST_TABLE_BITS];
+static uint8_t generation = 1; /* 1 to 255, see zobrist_age() */
 
 // wyhash-like stateless PRNG
 static inline uint64_t wyhash64_stateless(uint64_t *seed)
@@ -35,49 +58,79 @@ void zobrist_init(void)
         zobrist_table[i][0] = wyhash64();
         zobrist_table[i][1] = wyhash64();
     }
+    zobrist_player = wyhash64();
+}
 
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        INIT_HLIST_HEAD(&hash_table[i]);
-    }
+static zobrist_slot_t *cluster_of(uint64_t key)
+{
+    return &hash_table[key & ZOBRIST_TABLE_MASK & ~(ZOBRIST_WAYS - 1)];
 }
 
-zobrist_entry_t *zobrist_get(uint64_t key)
+/* Copy the entry of slot and return the key it was stored for */
+static uint64_t slot_read(const zobrist_slot_t *slot, zobrist_entry_t *entry)
 {
-    uint64_t hash_key = HASH(key);
-    if (hlist_empty(&hash_table[hash_key]))
-        return NULL;
+    union zobrist_word w = {
+        .data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED)};
+    *entry = w.entry;
+    return __atomic_load_n(&slot->lock, __ATOMIC_RELAXED) ^ w.data;
+}
 
-    zobrist_entry_t *entry;
-    hlist_for_each_entry(entry, &hash_table[hash_key], ht_list) {
-        if (entry->key == key)
-            return entry;
+bool zobrist_get(uint64_t key, zobrist_entry_t *entry)
+{
+    zobrist_slot_t *slot = cluster_of(key);
+    for (int i = 0; i < ZOBRIST_WAYS; i++, slot++) {
+        if (slot_read(slot, entry) == key && entry->age)
+            return true;
     }
-    return NULL;
+    return false;
 }
 
-void zobrist_put(uint64_t key, int score, int move)
+/* Whether a is replaced before b: entries of older generations go first,
+ * then the ones searched least deep.
+ */
+static bool evicts_before(const zobrist_entry_t *a,
+                          const zobrist_entry_t *b,
+                          uint8_t age)
 {
-    uint64_t hash_key = HASH(key);
-    zobrist_entry_t *new_entry = malloc(sizeof(zobrist_entry_t));
-    if (!new_entry) {
-        fprintf(stderr, "zobrist_put: malloc failed\n");
-        return;
-    }
-    new_entry->key = key;
-    new_entry->score = score;
-    new_entry->move = move;
-    hlist_add_head(&new_entry->ht_list, &hash_table[hash_key]);
+    if ((a->age == age) != (b->age == age))
+        return b->age == age;
+    return a->depth < b->depth;
 }
 
-void zobrist_clear(void)
+/* Replace the entry of the same position, else the first one to evict */
+void zobrist_put(uint64_t key, int score, int move, int depth, int bound)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&hash_table[i])) {
-            zobrist_entry_t *entry =
-                hlist_entry(hash_table[i].first, zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            free(entry);
+    zobrist_slot_t *slot = cluster_of(key), *victim = NULL;
+    zobrist_entry_t entry, victim_entry;
+    uint8_t age = __atomic_load_n(&generation, __ATOMIC_RELAXED);
+    for (int i = 0; i < ZOBRIST_WAYS; i++, slot++) {
+        if (slot_read(slot, &entry) == key && entry.age) {
+            victim = slot;
+            break;
+        }
+        if (!victim || evicts_before(&entry, &victim_entry, age)) {
+            victim = slot;
+            victim_entry = entry;
         }
-        INIT_HLIST_HEAD(&hash_table[i]);
     }
+    union zobrist_word w = {
+        .entry = {.score = score,
+                  .move = move,
+                  .depth = depth,
+                  .bound = bound,
+                  .age = age},
+    };
+    __atomic_store_n(&victim->data, w.data, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->lock, key ^ w.data, __ATOMIC_RELAXED);
+}
+
+/* One generation per search, skipping 0 which marks an empty slot */
+void zobrist_age(void)
+{
+    uint8_t old = __atomic_load_n(&generation, __ATOMIC_RELAXED), new;
+    /* Threads may age the table together, none may store 0 */
+    do {
+        new = old == UINT8_MAX ? 1 : old + 1;
+    } while (!__atomic_compare_exchange_n(&generation, &old, new, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
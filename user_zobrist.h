@@ -1,28 +1,57 @@
 #ifndef USER_ZOBRIST_H
 #define USER_ZOBRIST_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "bitboard.h"
 #include "game_util.h"
-#include "user_hlist.h"
 
-#define HASH_TABLE_SIZE 1024
+/* Same layout as the kernel transposition table: 2^ZOBRIST_TABLE_BITS
+ * slots in clusters of ZOBRIST_WAYS that a key may occupy.
+ */
+#define ZOBRIST_TABLE_BITS 17
+#define ZOBRIST_WAYS 4
 
 struct state_array {
     uint64_t array[2];
 };
 
+/* How score relates to the value of the position */
+enum { ZOBRIST_EXACT, ZOBRIST_LOWER, ZOBRIST_UPPER };
+
+/* Packed into one word, see user_zobrist.c */
 typedef struct zobrist_entry {
-    uint64_t key;
-    int score;
-    int move;
-    struct hlist_node ht_list;
+    int32_t score;
+    int8_t move;
+    uint8_t depth;
+    uint8_t bound;
+    uint8_t age; /* generation that stored the entry, 0 for an empty slot */
 } zobrist_entry_t;
 
 extern uint64_t zobrist_table[UTIL_N_GRIDS][2];
+extern uint64_t zobrist_player; /* added to the key when 'O' is to move */
 
 void zobrist_init(void);
-void zobrist_clear(void);
-zobrist_entry_t *zobrist_get(uint64_t key);
-void zobrist_put(uint64_t key, int score, int move);
+void zobrist_age(void);
+
+/* Copy the entry stored for key into *entry, return false if there is none.
+ * Threads may call this and zobrist_put() concurrently.
+ */
+bool zobrist_get(uint64_t key, zobrist_entry_t *entry);
+void zobrist_put(uint64_t key, int score, int move, int depth, int bound);
+
+/* Key of the stones on b. The transposition tables are keyed by the
+ * canonical form of a position, see board_canonical().
+ */
+static inline uint64_t zobrist_board_key(const board_t *b)
+{
+    uint64_t key = 0;
+    int cell;
+    for (int i = 0; i < 2; i++) {
+        bitboard_for_each(cell, b->bits[i])
+            key ^= zobrist_table[cell][i];
+    }
+    return key;
+}
 
 #endif
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bitboard.h"
 #include "game.h"
 
 static inline int eval_line_segment_score(const char *table,
@@ -44,3 +45,84 @@ static inline int get_score(const char *table, char player)
     }
     return score;
 }
+
+/* get_score() on a bitboard: a segment holding only one side's stones is worth
+ * line_scores[count] to that side, mixed or empty segments are worth nothing.
+ */
+static inline int get_board_score(const board_t *b, char player)
+{
+    bitboard_t own = b->bits[PLAYER_INDEX(player)];
+    bitboard_t opp = b->bits[!PLAYER_INDEX(player)];
+    int score = 0;
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        bitboard_t line = line_masks[i].line;
+        int n_own = bb_popcount(own & line), n_opp = bb_popcount(opp & line);
+        if (!n_opp)
+            score += line_scores[n_own];
+        else if (!n_own)
+            score -= line_scores[n_opp];
+    }
+    return score;
+}
+
+/* Evaluation state kept up to date across make/unmake: the number of stones
+ * each side has on every segment and the resulting get_score() for 'O', so a
+ * move only revisits the segments through its cell.
+ */
+typedef struct {
+    board_t board;
+    uint8_t count[2][N_LINE_SEGMENTS];
+    int score;
+} eval_t;
+
+/* Contribution of one segment to the score of the side owning n_own stones */
+static inline int segment_score(int n_own, int n_opp)
+{
+    if (!n_opp)
+        return line_scores[n_own];
+    if (!n_own)
+        return -line_scores[n_opp];
+    return 0;
+}
+
+static inline void eval_init(eval_t *e, const board_t *b)
+{
+    e->board = *b;
+    e->score = 0;
+    for (int i = 0; i < N_LINE_SEGMENTS; i++) {
+        bitboard_t line = line_masks[i].line;
+        e->count[0][i] = bb_popcount(b->bits[0] & line);
+        e->count[1][i] = bb_popcount(b->bits[1] & line);
+        e->score += segment_score(e->count[0][i], e->count[1][i]);
+    }
+}
+
+static inline void eval_update(eval_t *e, int move, char player, int delta)
+{
+    uint8_t *own = e->count[PLAYER_INDEX(player)];
+    const uint8_t *ids = cell_line_ids[move];
+    for (int i = 0; i < n_cell_lines[move]; i++) {
+        int s = ids[i];
+        e->score -= segment_score(e->count[0][s], e->count[1][s]);
+        own[s] += delta;
+        e->score += segment_score(e->count[0][s], e->count[1][s]);
+    }
+}
+
+static inline void eval_play(eval_t *e, int move, char player)
+{
+    board_play(&e->board, move, player);
+    eval_update(e, move, player, 1);
+}
+
+static inline void eval_undo(eval_t *e, int move, char player)
+{
+    board_undo(&e->board, move, player);
+    eval_update(e, move, player, -1);
+}
+
+/* get_score() of the current position for player */
+static inline int eval_score(const eval_t *e, char player)
+{
+    return player == 'O' ? e->score : -e->score;
+}
@@ -0,0 +1,120 @@
+/* Throughput of /dev/kxo against the number of clients. Every client opens
+ * the device on its own and plays games against itself, 'O' searched by MCTS
+ * and 'X' by negamax in the kernel, until the time of a round is up. The
+ * number of clients doubles from one round to the next.
+ *
+ * Games are judged by game.c, which the module is built from, so that they
+ * end where the module sees them end: under its rules lines longer than GOAL
+ * win as well, unlike under those of game_util.c.
+ *
+ * Usage: xo-bench [MAX_CLIENTS [SECONDS]]
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitboard.h"
+#include "game.h"
+#include "xo_common.h"
+
+#define XO_DEVICE_FILE "/dev/kxo"
+#define MAX_CLIENTS 256
+
+struct client {
+    pthread_t thread;
+    double deadline;
+    long moves;
+    double busy; /* seconds spent waiting for the moves */
+    bool failed;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *client_run(void *arg)
+{
+    struct client *c = arg;
+    int fd = open(XO_DEVICE_FILE, O_RDWR);
+    if (fd < 0) {
+        perror("open " XO_DEVICE_FILE);
+        c->failed = true;
+        return NULL;
+    }
+
+    struct xo_board board = {.budget_us = 0};
+    struct xo_result result;
+    while (now() < c->deadline) {
+        memset(board.table, ' ', XO_BOARD_SIZE);
+        board.player = 'O';
+        while (check_win(board.table) == ' ' && now() < c->deadline) {
+            double start = now();
+            board.id = c->moves;
+            if (write(fd, &board, sizeof(board)) != sizeof(board) ||
+                read(fd, &result, sizeof(result)) != sizeof(result)) {
+                perror(XO_DEVICE_FILE);
+                c->failed = true;
+                goto out;
+            }
+            c->busy += now() - start;
+            if (result.move < 0)
+                break;
+            board.table[result.move] = board.player;
+            board.player = board.player == 'O' ? 'X' : 'O';
+            c->moves++;
+        }
+    }
+out:
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_clients = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 5;
+    if (max_clients < 1 || max_clients > MAX_CLIENTS || seconds <= 0) {
+        fprintf(stderr, "Usage: %s [MAX_CLIENTS [SECONDS]]\n", argv[0]);
+        return 1;
+    }
+    bitboard_init();
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    static struct client clients[MAX_CLIENTS];
+    printf("%8s %12s %14s\n", "clients", "moves/s", "latency (ms)");
+    for (int n = 1; n <= max_clients; n *= 2) {
+        double start = now();
+        for (int i = 0; i < n; i++) {
+            clients[i] = (struct client){.deadline = start + seconds};
+            if (pthread_create(&clients[i].thread, NULL, client_run,
+                               &clients[i])) {
+                perror("pthread_create");
+                return 1;
+            }
+        }
+        long moves = 0;
+        double busy = 0;
+        bool failed = false;
+        for (int i = 0; i < n; i++) {
+            pthread_join(clients[i].thread, NULL);
+            moves += clients[i].moves;
+            busy += clients[i].busy;
+            failed |= clients[i].failed;
+        }
+        if (failed)
+            return 1;
+        double elapsed = now() - start;
+        printf("%8d %12.1f %14.3f\n", n, moves / elapsed,
+               moves ? busy * 1e3 / moves : 0);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* Check the incremental evaluation of util.h against a full recompute. Random
+ * sequences of moves are played and taken back, and after every step
+ * eval_score() must equal get_score() and get_board_score() for both sides.
+ *
+ * Link with game.c for the rules of the kernel module, or with game_util.c
+ * for those of the userspace engines.
+ *
+ * Usage: xo-eval-check [SEQUENCES [SEED]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitboard.h"
+#include "util.h"
+
+#define STEPS 64
+
+static int check(const eval_t *e, const char *table, long seq, int step)
+{
+    static const char players[] = {'O', 'X'};
+    for (int i = 0; i < 2; i++) {
+        char player = players[i];
+        int want = get_score(table, player);
+        int got = eval_score(e, player);
+        if (got != want || get_board_score(&e->board, player) != want) {
+            fprintf(stderr,
+                    "sequence %ld, step %d: eval_score(%c) = %d, "
+                    "get_score = %d, get_board_score = %d\n",
+                    seq, step, player, got, want,
+                    get_board_score(&e->board, player));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    long n_sequences = argc > 1 ? atol(argv[1]) : 100000;
+    unsigned int seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    if (argc > 3 || n_sequences < 1) {
+        fprintf(stderr, "Usage: %s [SEQUENCES [SEED]]\n", argv[0]);
+        return 1;
+    }
+    bitboard_init();
+    srand(seed);
+
+    for (long seq = 0; seq < n_sequences; seq++) {
+        char table[N_GRIDS];
+        int moves[N_GRIDS], n_moves = 0;
+        board_t empty_board = {{0, 0}};
+        eval_t e;
+        memset(table, ' ', N_GRIDS);
+        eval_init(&e, &empty_board);
+        if (check(&e, table, seq, 0))
+            return 1;
+
+        /* Undo a third of the time, so positions are reached both ways */
+        for (int step = 1; step <= STEPS; step++) {
+            char player = n_moves & 1 ? 'X' : 'O';
+            if (n_moves && (n_moves == N_GRIDS || rand() % 3 == 0)) {
+                int move = moves[--n_moves];
+                player = n_moves & 1 ? 'X' : 'O';
+                eval_undo(&e, move, player);
+                table[move] = ' ';
+            } else {
+                bitboard_t empty = board_empty(&e.board);
+                int move = bitboard_nth(empty, rand() % bb_popcount(empty));
+                eval_play(&e, move, player);
+                table[move] = player;
+                moves[n_moves++] = move;
+            }
+            if (check(&e, table, seq, step))
+                return 1;
+        }
+
+        /* A fresh evaluation of the final position agrees as well */
+        eval_init(&e, &e.board);
+        if (check(&e, table, seq, STEPS + 1))
+            return 1;
+    }
+    printf("%ld sequences of %d steps: incremental scores match\n",
+           n_sequences, STEPS);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/* Play the userspace engines against each other, 'O' searched by MCTS and
+ * 'X' by negamax, under several settings of their options, and check that
+ * every move they pick is legal. With a TABLEBASE written by xo-tablebase
+ * from game_util.c, the covered positions are answered from it.
+ *
+ * Usage: xo-selfplay [GAMES [TABLEBASE]]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ai_mcts.h"
+#include "ai_negamax.h"
+#include "game_util.h"
+#include "tablebase.h"
+
+struct setting {
+    const char *name;
+    int mcts_threads, mcts_batch;
+    unsigned int budget_us; /* 0 for the fixed number of iterations */
+    int negamax_threads, negamax_depth;
+    bool lmr, futility;
+};
+
+static const struct setting settings[] = {
+    {"defaults", 1, 1, 0, 1, 6, false, false},
+    {"batched playouts", 1, 16, 0, 1, 6, false, false},
+    {"4 MCTS threads", 4, 1, 0, 1, 6, false, false},
+    {"timed MCTS", 2, 4, 2000, 1, 6, false, false},
+    {"lazy SMP negamax", 1, 1, 0, 4, 6, false, false},
+    {"pruned negamax", 1, 1, 0, 2, 8, true, true},
+};
+
+/* Play one game and return its winner, 'D' for a draw, or 0 after an
+ * illegal move
+ */
+static char play(const struct setting *s)
+{
+    char table[N_GRIDS];
+    char player = 'O';
+    memset(table, ' ', N_GRIDS);
+    for (char win; (win = check_win(table)) == ' ';
+         player = player == 'O' ? 'X' : 'O') {
+        int move = player == 'O'
+                       ? mcts(table, player, s->budget_us, NULL)
+                       : negamax_predict(table, player).move;
+        if (move < 0 || move >= N_GRIDS || table[move] != ' ') {
+            fprintf(stderr, "%s: %c played %d\n", s->name, player, move);
+            return 0;
+        }
+        table[move] = player;
+    }
+    return check_win(table);
+}
+
+int main(int argc, char *argv[])
+{
+    int n_games = argc > 1 ? atoi(argv[1]) : 10;
+    if (argc > 3 || n_games < 1) {
+        fprintf(stderr, "Usage: %s [GAMES [TABLEBASE]]\n", argv[0]);
+        return 1;
+    }
+    mcts_init();
+    negamax_init();
+    if (argc > 2 && tablebase_load(argv[2])) {
+        fprintf(stderr, "%s: not a tablebase for these rules\n", argv[2]);
+        return 1;
+    }
+
+    printf("%-18s %6s %6s %6s\n", "setting", "O won", "X won", "draws");
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+        const struct setting *s = &settings[i];
+        int count[3] = {0};
+        mcts_set_seed(1);
+        mcts_set_threads(s->mcts_threads);
+        mcts_set_batch(s->mcts_batch);
+        negamax_set_threads(s->negamax_threads);
+        negamax_set_depth(s->negamax_depth);
+        negamax_set_pruning(s->lmr, s->futility);
+        for (int g = 0; g < n_games; g++) {
+            char win = play(s);
+            if (!win)
+                return 1;
+            count[win == 'O' ? 0 : win == 'X' ? 1 : 2]++;
+        }
+        printf("%-18s %6d %6d %6d\n", s->name, count[0], count[1], count[2]);
+    }
+    return 0;
+}
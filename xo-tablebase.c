@@ -0,0 +1,101 @@
+/* Solve every position of the board and write the tablebase read by the
+ * kernel module (as firmware) and by the userspace engines.
+ *
+ * Placing a stone only adds to the base-3 index of a position, so walking
+ * the indexes downwards meets every position after all of its successors
+ * and each one is settled from their values in a single pass.
+ *
+ * Link with game.c for the rules of the kernel module, or with game_util.c
+ * for those of the userspace engines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitboard.h"
+#include "tablebase.h"
+
+static uint8_t *values;
+
+static void set_value(uint32_t index, int value)
+{
+    values[index >> 2] |= value << ((index & 3) * 2);
+}
+
+/* Value for the side to move of the position whose cells are digits[] */
+static int solve(uint32_t index, const uint8_t *digits, const uint32_t *pow3)
+{
+    board_t b = {{0, 0}};
+    for (int i = 0; i < N_GRIDS; i++) {
+        if (digits[i])
+            b.bits[digits[i] - 1] |= BB_CELL(i);
+    }
+    int n_o = bb_popcount(b.bits[0]), n_x = bb_popcount(b.bits[1]);
+    if (n_o != n_x && n_o != n_x + 1)
+        return TB_UNKNOWN;
+    int side = n_o != n_x; /* PLAYER_INDEX() of the side to move */
+    if (bitboard_has_win(b.bits[side]))
+        return TB_UNKNOWN; /* the game ended before */
+    if (bitboard_has_win(b.bits[!side]))
+        return TB_LOSS;
+    if (!board_empty(&b))
+        return TB_DRAW;
+
+    int best = TB_LOSS, move;
+    bitboard_for_each(move, board_empty(&b)) {
+        int value = tablebase_value(values, index + (side + 1) * pow3[move]);
+        if (value == TB_LOSS)
+            return TB_WIN;
+        if (value == TB_DRAW)
+            best = TB_DRAW;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s OUTPUT\n", argv[0]);
+        return 1;
+    }
+    bitboard_init();
+
+    uint32_t n_positions = tablebase_size(), pow3[N_GRIDS];
+    for (int i = 0; i < N_GRIDS; i++)
+        pow3[i] = i ? pow3[i - 1] * 3 : 1;
+    values = calloc((n_positions + 3) / 4, 1);
+    if (!values) {
+        perror("calloc");
+        return 1;
+    }
+
+    /* digits[] counts down from the last position */
+    uint8_t digits[N_GRIDS];
+    memset(digits, 2, sizeof(digits));
+    unsigned long count[4] = {0};
+    for (uint32_t index = n_positions; index--;) {
+        int value = solve(index, digits, pow3);
+        set_value(index, value);
+        count[value]++;
+        for (int i = 0; i < N_GRIDS && digits[i]-- == 0; i++)
+            digits[i] = 2;
+    }
+
+    struct tablebase_header header = {
+        .magic = TABLEBASE_MAGIC,
+        .board_size = BOARD_SIZE,
+        .goal = GOAL,
+        .allow_exceed = tablebase_allow_exceed(),
+        .n_positions = n_positions,
+    };
+    FILE *fp = fopen(argv[1], "wb");
+    if (!fp || fwrite(&header, sizeof(header), 1, fp) != 1 ||
+        fwrite(values, (n_positions + 3) / 4, 1, fp) != 1 || fclose(fp)) {
+        perror(argv[1]);
+        return 1;
+    }
+    printf("%s: %lu wins, %lu draws, %lu losses for the side to move\n",
+           argv[1], count[TB_WIN], count[TB_DRAW], count[TB_LOSS]);
+    return 0;
+}
@@ -3,6 +3,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -114,6 +115,11 @@ int device_fd = -1;
 char tables[2][XO_BOARD_SIZE];
 int turns[2] = {1, 1};
 bool finished[2] = {false, false};
+/* A game waits for the module while its request is in flight, the results
+ * come back tagged with the index of the game.
+ */
+bool searching[2] = {false, false};
+struct xo_result results[2];
 volatile bool should_redraw = false;
 ssize_t written;
 
@@ -291,6 +297,27 @@ cr_proto(display_loop)
     cr_end();
 }
 
+cr_context(device_loop);
+cr_proto(device_loop)
+{
+    cr_local struct xo_result result;
+    cr_local ssize_t rret;
+    cr_begin();
+    for (;;) {
+        cr_sys(rret = read(device_fd, &result, sizeof(result)));
+        if (rret != sizeof(result)) {
+            perror("read /dev/kxo failed");
+            cr_exit(CR_FINISHED);
+        }
+        if (result.id < 2 && searching[result.id]) {
+            results[result.id] = result;
+            searching[result.id] = false;
+        }
+        cr_yield;
+    }
+    cr_end();
+}
+
 cr_context(ai1_loop_0);
 cr_context(ai2_loop_0);
 cr_context(ai1_loop_1);
@@ -300,25 +327,22 @@ cr_proto(ai1_loop_0)
 {
     cr_local int move;
     cr_local struct xo_board board;
-    cr_local struct xo_result result;
-    cr_local ssize_t wret, rret;
+    cr_local ssize_t wret;
     cr_begin();
     while (!finished[0]) {
         cr_wait(turns[0] == 1);
 
         memcpy(board.table, tables[0], XO_BOARD_SIZE);  // 16 for 4x4
         board.player = 'O';
+        board.id = 0;
         wret = write(device_fd, &board, sizeof(board));
         if (wret != sizeof(board)) {
             perror("write /dev/kxo failed");
             cr_exit(CR_FINISHED);
         }
-        rret = read(device_fd, &result, sizeof(result));
-        if (rret != sizeof(result)) {
-            perror("read /dev/kxo failed");
-            cr_exit(CR_FINISHED);
-        }
-        move = result.move;
+        searching[0] = true;
+        cr_wait(!searching[0]);
+        move = results[0].move;
         if (move != -1)
             tables[0][move] = 'O';
         if (check_win(tables[0]) != ' ')
@@ -333,25 +357,22 @@ cr_proto(ai2_loop_0)
 {
     cr_local int move;
     cr_local struct xo_board board;
-    cr_local struct xo_result result;
-    cr_local ssize_t wret, rret;
+    cr_local ssize_t wret;
     cr_begin();
     while (!finished[0]) {
         cr_wait(turns[0] == 2);
 
         memcpy(board.table, tables[0], XO_BOARD_SIZE);
         board.player = 'X';
+        board.id = 0;
         wret = write(device_fd, &board, sizeof(board));
         if (wret != sizeof(board)) {
             perror("write /dev/kxo failed");
             cr_exit(CR_FINISHED);
         }
-        rret = read(device_fd, &result, sizeof(result));
-        if (rret != sizeof(result)) {
-            perror("read /dev/kxo failed");
-            cr_exit(CR_FINISHED);
-        }
-        move = result.move;
+        searching[0] = true;
+        cr_wait(!searching[0]);
+        move = results[0].move;
         if (move != -1)
             tables[0][move] = 'X';
         if (check_win(tables[0]) != ' ')
@@ -366,25 +387,22 @@ cr_proto(ai1_loop_1)
 {
     cr_local int move;
     cr_local struct xo_board board;
-    cr_local struct xo_result result;
-    cr_local ssize_t wret, rret;
+    cr_local ssize_t wret;
     cr_begin();
     while (!finished[1]) {
         cr_wait(turns[1] == 1);
 
         memcpy(board.table, tables[1], XO_BOARD_SIZE);
         board.player = 'O';
+        board.id = 1;
         wret = write(device_fd, &board, sizeof(board));
         if (wret != sizeof(board)) {
             perror("write /dev/kxo failed");
             cr_exit(CR_FINISHED);
         }
-        rret = read(device_fd, &result, sizeof(result));
-        if (rret != sizeof(result)) {
-            perror("read /dev/kxo failed");
-            cr_exit(CR_FINISHED);
-        }
-        move = result.move;
+        searching[1] = true;
+        cr_wait(!searching[1]);
+        move = results[1].move;
         if (move != -1)
             tables[1][move] = 'O';
         if (check_win(tables[1]) != ' ')
@@ -399,25 +417,22 @@ cr_proto(ai2_loop_1)
 {
     cr_local int move;
     cr_local struct xo_board board;
-    cr_local struct xo_result result;
-    cr_local ssize_t wret, rret;
+    cr_local ssize_t wret;
     cr_begin();
     while (!finished[1]) {
         cr_wait(turns[1] == 2);
 
         memcpy(board.table, tables[1], XO_BOARD_SIZE);
         board.player = 'X';
+        board.id = 1;
         wret = write(device_fd, &board, sizeof(board));
         if (wret != sizeof(board)) {
             perror("write /dev/kxo failed");
             cr_exit(CR_FINISHED);
         }
-        rret = read(device_fd, &result, sizeof(result));
-        if (rret != sizeof(result)) {
-            perror("read /dev/kxo failed");
-            cr_exit(CR_FINISHED);
-        }
-        move = result.move;
+        searching[1] = true;
+        cr_wait(!searching[1]);
+        move = results[1].move;
         if (move != -1)
             tables[1][move] = 'X';
         if (check_win(tables[1]) != ' ')
@@ -472,16 +487,19 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    raw_mode_enable();
-    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
-    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+    bitboard_init();
 
-    int device_fd = open(XO_DEVICE_FILE, O_RDONLY);
-    if (device_fd < 0) {
-        perror("open /dev/kxo");
+    /* Searches run while the games are drawn, reads only pick up results */
+    if (nonblock(device_fd) < 0) {
+        perror("fcntl /dev/kxo");
         return 1;
     }
 
+    raw_mode_enable();
+    int flags = fcntl(STDIN_FILENO, F_GETFL, 0);
+    fcntl(STDIN_FILENO, F_SETFL, flags | O_NONBLOCK);
+
+    cr_context(device_loop) = cr_context_init();
     cr_context(keyboard_loop) = cr_context_init();
     cr_context(display_loop) = cr_context_init();
 
@@ -491,6 +509,20 @@ int main(int argc, char *argv[])
     turns[1] = 1;
 
     while (!end_attr) {
+        /* Sleep until a search is done or a key is pressed, unless a game
+         * can move on by itself.
+         */
+        if ((searching[0] || finished[0]) && (searching[1] || finished[1])) {
+            struct pollfd fds[] = {
+                {.fd = device_fd, .events = POLLIN},
+                {.fd = STDIN_FILENO, .events = POLLIN},
+            };
+            poll(fds, 2, 1000);
+        }
+        cr_run(device_loop);
+        if (cr_status(device_loop) == CR_FINISHED)
+            break;
+
         if (!finished[0]) {
             if (turns[0] == 1 && cr_status(ai1_loop_0) != CR_FINISHED)
                 cr_run(ai1_loop_0);
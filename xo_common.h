@@ -6,8 +6,12 @@
 struct xo_board {
     char table[XO_BOARD_SIZE];
     char player;
+    unsigned int budget_us; /* MCTS time limit, 0 for the module default */
+    unsigned int id;        /* chosen by the client, copied to the result */
 } __attribute__((packed));
 
 struct xo_result {
     int move;
+    int iterations; /* MCTS iterations run for the move, 0 for negamax */
+    unsigned int id; /* of the request */
 };
@@ -24,14 +24,12 @@ u64 xoro_next(struct state_array *obj)
     return result;
 }
 
-void xoro_jump(struct state_array *obj)
+static void jump(struct state_array *obj, const u64 *JUMP)
 {
-    static const u64 JUMP[] = {0xdf900294d8f554a5, 0x170865df4b3201fc};
-
     u64 s0 = 0;
     u64 s1 = 0;
     int i, b;
-    for (i = 0; i < sizeof(JUMP) / sizeof(*JUMP); i++) {
+    for (i = 0; i < 2; i++) {
         for (b = 0; b < 64; b++) {
             if (JUMP[i] & (u64) (1) << b) {
                 s0 ^= obj->array[0];
@@ -45,7 +43,37 @@ void xoro_jump(struct state_array *obj)
     obj->array[1] = s1;
 }
 
+/* Equivalent to 2^64 calls to xoro_next() */
+void xoro_jump(struct state_array *obj)
+{
+    static const u64 JUMP[] = {0xdf900294d8f554a5, 0x170865df4b3201fc};
+    jump(obj, JUMP);
+}
+
+/* Equivalent to 2^96 calls to xoro_next(), to start independent streams */
+void xoro_long_jump(struct state_array *obj)
+{
+    static const u64 LONG_JUMP[] = {0xd2a98b26625eee7b, 0xdddf9b1090aa7ac1};
+    jump(obj, LONG_JUMP);
+}
+
+/* SplitMix64, which spreads a small seed over the whole state */
+static u64 splitmix64(u64 *x)
+{
+    u64 z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
 void xoro_init(struct state_array *obj)
 {
     seed(obj, 314159265, 1618033989);
 }
+
+/* The same seed always gives the same stream */
+void xoro_seed(struct state_array *obj, u64 s)
+{
+    u64 s0 = splitmix64(&s);
+    seed(obj, s0, splitmix64(&s));
+}
@@ -8,4 +8,14 @@ struct state_array {
 
 u64 xoro_next(struct state_array *obj);
 void xoro_jump(struct state_array *obj);
+void xoro_long_jump(struct state_array *obj);
 void xoro_init(struct state_array *obj);
+void xoro_seed(struct state_array *obj, u64 seed);
+
+/* Uniform draw in [0, n) from the high bits by a multiply and a shift instead
+ * of a division, biased by at most n / 2^32.
+ */
+static inline u32 xoro_bounded(struct state_array *obj, u32 n)
+{
+    return ((xoro_next(obj) >> 32) * n) >> 32;
+}
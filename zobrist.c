@@ -1,12 +1,36 @@
+#include <linux/atomic.h>
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/string.h>
 
 #include "zobrist.h"
 
 u64 zobrist_table[N_GRIDS][2];
+u64 zobrist_player;
 
-#define HASH(key) ((key) % HASH_TABLE_SIZE)
+#define ZOBRIST_TABLE_MASK ((1U << ZOBRIST_TABLE_BITS) - 1)
 
-static struct hlist_head *hash_table;
+/* Searches running in parallel share the table without locking. A slot holds
+ * its entry packed into one word and the key XORed with that word, so an
+ * entry torn between two writers matches no key and reads as a miss.
+ */
+typedef struct {
+    u64 lock;
+    u64 data;
+} zobrist_slot_t;
+
+union zobrist_word {
+    zobrist_entry_t entry;
+    u64 data;
+};
+
+/* Entries stay valid across searches, the generation that stored them only
+ * tells which ones can be replaced first.
+ */
+static zobrist_slot_t *hash_table;
+static atomic_t generation = ATOMIC_INIT(1); /* 1 to 255 */
 
 /* See https://github.com/wangyi-fudan/wyhash
  */
@@ -27,58 +51,111 @@ static u64 wyhash64(void)
     return wyhash64_stateless(&seed);
 }
 
-void zobrist_init(void)
+/* Called by both engines, only the first call does anything */
+int zobrist_init(void)
 {
     int i;
+    if (hash_table)
+        return 0;
     for (i = 0; i < N_GRIDS; i++) {
         zobrist_table[i][0] = wyhash64();
         zobrist_table[i][1] = wyhash64();
     }
-    hash_table =
-        kmalloc(sizeof(struct hlist_head) * HASH_TABLE_SIZE, GFP_KERNEL);
+    zobrist_player = wyhash64();
+    BUILD_BUG_ON(sizeof(zobrist_entry_t) != sizeof(u64));
+    hash_table = kvcalloc(1U << ZOBRIST_TABLE_BITS, sizeof(zobrist_slot_t),
+                          GFP_KERNEL);
     if (!hash_table) {
-        pr_info("kxo: Failed to allocate space for hash_table\n");
-        return;
+        pr_err("kxo: Failed to allocate space for hash_table\n");
+        return -ENOMEM;
     }
-    for (i = 0; i < HASH_TABLE_SIZE; i++)
-        INIT_HLIST_HEAD(&hash_table[i]);
+    return 0;
 }
 
-zobrist_entry_t *zobrist_get(u64 key)
+void zobrist_exit(void)
 {
-    unsigned long long hash_key = HASH(key);
+    kvfree(hash_table);
+    hash_table = NULL;
+}
 
-    if (hlist_empty(&hash_table[hash_key]))
-        return NULL;
+static zobrist_slot_t *cluster_of(u64 key)
+{
+    return &hash_table[key & ZOBRIST_TABLE_MASK & ~(ZOBRIST_WAYS - 1)];
+}
+
+/* Copy the entry of slot and return the key it was stored for */
+static u64 slot_read(const zobrist_slot_t *slot, zobrist_entry_t *entry)
+{
+    union zobrist_word w = {.data = READ_ONCE(slot->data)};
+
+    *entry = w.entry;
+    return READ_ONCE(slot->lock) ^ w.data;
+}
 
-    zobrist_entry_t *entry = NULL;
+bool zobrist_get(u64 key, zobrist_entry_t *entry)
+{
+    zobrist_slot_t *slot = cluster_of(key);
 
-    hlist_for_each_entry(entry, &hash_table[hash_key], ht_list) {
-        if (entry->key == key)
-            return entry;
+    for (int i = 0; i < ZOBRIST_WAYS; i++, slot++) {
+        if (slot_read(slot, entry) == key && entry->age)
+            return true;
     }
-    return NULL;
+    return false;
 }
 
-void zobrist_put(u64 key, int score, int move)
+/* Whether a is replaced before b: entries of older generations go first,
+ * then those searched least deep.
+ */
+static bool evicts_before(const zobrist_entry_t *a,
+                          const zobrist_entry_t *b,
+                          u8 age)
 {
-    unsigned long long hash_key = HASH(key);
-    zobrist_entry_t *new_entry = kmalloc(sizeof(zobrist_entry_t), GFP_KERNEL);
-    new_entry->key = key;
-    new_entry->move = move;
-    new_entry->score = score;
-    hlist_add_head(&new_entry->ht_list, &hash_table[hash_key]);
+    if ((a->age == age) != (b->age == age))
+        return b->age == age;
+    return a->depth < b->depth;
 }
 
-void zobrist_clear(void)
+/* Overwrite the entry of the same position if there is one, otherwise the
+ * first to evict.
+ */
+void zobrist_put(u64 key, int score, int move, int depth, int bound)
 {
-    for (int i = 0; i < HASH_TABLE_SIZE; i++) {
-        while (!hlist_empty(&hash_table[i])) {
-            zobrist_entry_t *entry =
-                hlist_entry(hash_table[i].first, zobrist_entry_t, ht_list);
-            hlist_del(&entry->ht_list);
-            kfree(entry);
+    zobrist_slot_t *slot = cluster_of(key), *victim = NULL;
+    zobrist_entry_t entry, victim_entry;
+    u8 age = atomic_read(&generation);
+
+    for (int i = 0; i < ZOBRIST_WAYS; i++, slot++) {
+        if (slot_read(slot, &entry) == key && entry.age) {
+            victim = slot;
+            break;
+        }
+        if (!victim || evicts_before(&entry, &victim_entry, age)) {
+            victim = slot;
+            victim_entry = entry;
         }
-        INIT_HLIST_HEAD(&hash_table[i]);
     }
+
+    union zobrist_word w = {
+        .entry = {.score = score,
+                  .move = move,
+                  .depth = depth,
+                  .bound = bound,
+                  .age = age},
+    };
+    WRITE_ONCE(victim->data, w.data);
+    WRITE_ONCE(victim->lock, key ^ w.data);
+}
+
+/* Called once per search. Ages are 8 bits and 0 marks an empty slot, so
+ * after 255 searches the oldest entries look new again, which only costs
+ * them their priority for replacement.
+ */
+void zobrist_age(void)
+{
+    int old = atomic_read(&generation), new;
+
+    /* Concurrent searches may age the table together, none may store 0 */
+    do {
+        new = old == U8_MAX ? 1 : old + 1;
+    } while (!atomic_try_cmpxchg(&generation, &old, new));
 }
@@ -1,21 +1,53 @@
 #pragma once
 
-#include <linux/list.h>
+#include <linux/types.h>
 
+#include "bitboard.h"
 #include "game.h"
 
-#define HASH_TABLE_SIZE (100003)
+/* The transposition table is one array of 2^ZOBRIST_TABLE_BITS slots, split
+ * into clusters of ZOBRIST_WAYS that a key may occupy.
+ */
+#define ZOBRIST_TABLE_BITS 17
+#define ZOBRIST_WAYS 4
 
 extern u64 zobrist_table[N_GRIDS][2];
+extern u64 zobrist_player; /* added to the key when 'O' is to move */
 
+/* How score relates to the value of the position */
+enum { ZOBRIST_EXACT, ZOBRIST_LOWER, ZOBRIST_UPPER };
+
+/* Packed into one word, see zobrist.c */
 typedef struct {
-    u64 key;
-    int score;
-    int move;
-    struct hlist_node ht_list;
+    s32 score;
+    s8 move;
+    u8 depth;
+    u8 bound;
+    u8 age; /* generation that stored the entry, 0 for an empty slot */
 } zobrist_entry_t;
 
-void zobrist_init(void);
-zobrist_entry_t *zobrist_get(u64 key);
-void zobrist_put(u64 key, int score, int move);
-void zobrist_clear(void);
+/* Return 0, or -ENOMEM if the transposition table cannot be allocated */
+int zobrist_init(void);
+void zobrist_exit(void);
+
+/* Copy the entry stored for key into *entry, return false if there is none.
+ * Searches running in parallel may call this and zobrist_put() at any time.
+ */
+bool zobrist_get(u64 key, zobrist_entry_t *entry);
+void zobrist_put(u64 key, int score, int move, int depth, int bound);
+void zobrist_age(void);
+
+/* Key of the stones on b. The transposition tables are keyed by the
+ * canonical form of a position, see board_canonical().
+ */
+static inline u64 zobrist_board_key(const board_t *b)
+{
+    u64 key = 0;
+    int cell;
+
+    for (int i = 0; i < 2; i++) {
+        bitboard_for_each(cell, b->bits[i])
+            key ^= zobrist_table[cell][i];
+    }
+    return key;
+}